@@ -0,0 +1,708 @@
+/* Cram - A texture packing system in C
+ *
+ * Copyright (c) 2022 Evan Hemsley
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from
+ * the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be
+ * appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Evan "cosmonaut" Hemsley <evan@moonside.games>
+ *
+ */
+
+/* Benchmarks for Cram, run through the public API on generated PNGs.
+ * The images are written to a scratch directory in the working directory first,
+ * and only Cram's own calls are timed. Runs are single-threaded and seeded
+ * unless they say otherwise, so runs on the same machine are comparable.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cram.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define SCRATCH_DIRECTORY "cram_bench_images"
+#define MAX_PATH_LENGTH 2048
+
+#define ARRAY_LENGTH(array) ((int32_t) (sizeof(array) / sizeof((array)[0])))
+
+static uint32_t randomState;
+
+static uint32_t next_random(void)
+{
+	/* xorshift32 */
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+static double get_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double) counter.QuadPart / frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+}
+
+static void init_create_info(Cram_ContextCreateInfo *createInfo)
+{
+	memset(createInfo, 0, sizeof(Cram_ContextCreateInfo));
+	createInfo->name = "bench";
+	createInfo->maxDimension = 8192;
+	createInfo->threadCount = 1;
+}
+
+/* Returns count paths in the scratch directory, which is created if it doesn't exist. */
+static char** create_scratch_paths(int32_t count)
+{
+	char **paths = malloc(sizeof(char*) * count);
+	int32_t i;
+
+#ifdef _WIN32
+	_mkdir(SCRATCH_DIRECTORY);
+#else
+	mkdir(SCRATCH_DIRECTORY, 0755);
+#endif
+
+	for (i = 0; i < count; i += 1)
+	{
+		paths[i] = malloc(MAX_PATH_LENGTH);
+		snprintf(paths[i], MAX_PATH_LENGTH, "%s%c%06d.png", SCRATCH_DIRECTORY, SEPARATOR, i);
+	}
+
+	return paths;
+}
+
+/* Deletes the files and the scratch directory, if nothing else is in it. */
+static void remove_scratch_files(char **paths, int32_t count)
+{
+	int32_t i;
+
+	for (i = 0; i < count; i += 1)
+	{
+		remove(paths[i]);
+		free(paths[i]);
+	}
+
+	free(paths);
+
+#ifdef _WIN32
+	_rmdir(SCRATCH_DIRECTORY);
+#else
+	rmdir(SCRATCH_DIRECTORY);
+#endif
+}
+
+/* An opaque image of one colour, different for every seed, so nothing is de-duplicated unless it is meant to be. */
+static void write_image(const char *path, int32_t width, int32_t height, uint32_t seed)
+{
+	uint8_t *pixels = malloc(width * height * 4);
+	int32_t i;
+
+	for (i = 0; i < width * height; i += 1)
+	{
+		pixels[i * 4 + 0] = (uint8_t) seed;
+		pixels[i * 4 + 1] = (uint8_t) (seed >> 8);
+		pixels[i * 4 + 2] = (uint8_t) (seed >> 16);
+		pixels[i * 4 + 3] = 255;
+	}
+
+	stbi_write_png(path, width, height, 4, pixels, width * 4);
+	free(pixels);
+}
+
+/* Writes images with random sides from minSide to maxSide, all different. */
+static void write_random_images(char **paths, int32_t count, int32_t minSide, int32_t maxSide)
+{
+	int32_t width, height;
+	int32_t i;
+
+	randomState = 1;
+
+	for (i = 0; i < count; i += 1)
+	{
+		width = minSide + next_random() % (maxSide - minSide + 1);
+		height = minSide + next_random() % (maxSide - minSide + 1);
+		write_image(paths[i], width, height, i);
+	}
+}
+
+/* Adds the images, then prints how long packing them took and how much of the atlas they cover. */
+static void add_and_pack(Cram_ContextCreateInfo *createInfo, const char *label, char **paths, int32_t count)
+{
+	Cram_Context *context = Cram_Init(createInfo);
+	Cram_ImageData *imageDatas;
+	uint8_t *pixelData;
+	int32_t imageCount, width, height;
+	double start, elapsed, area;
+	int32_t i;
+
+	for (i = 0; i < count; i += 1)
+	{
+		Cram_AddFile(context, paths[i]);
+	}
+
+	start = get_seconds();
+
+	if (Cram_Pack(context) < 0)
+	{
+		printf("  %-12s  failed\n", label);
+		Cram_Destroy(context);
+		return;
+	}
+
+	elapsed = get_seconds() - start;
+
+	Cram_GetPixelData(context, &pixelData, &width, &height);
+	Cram_GetMetadata(context, &imageDatas, &imageCount);
+
+	area = 0;
+	for (i = 0; i < imageCount; i += 1)
+	{
+		area += (double) imageDatas[i].width * imageDatas[i].height;
+	}
+
+	printf(
+		"  %-12s  %8.3f s  %7.2f us/rect  %5dx%-5d  %5.1f%% used\n",
+		label,
+		elapsed,
+		elapsed * 1e6 / count,
+		width,
+		height,
+		area * 100 / ((double) width * height)
+	);
+
+	Cram_Destroy(context);
+}
+
+/* Dedup: Cram_AddFile cost per image as the image count grows.
+ * A quarter of the images repeat an earlier one.
+ */
+static void bench_dedup(void)
+{
+	static const int32_t counts[] = { 1000, 5000, 25000, 50000 };
+	int32_t maxCount = counts[ARRAY_LENGTH(counts) - 1];
+	Cram_ContextCreateInfo createInfo;
+	Cram_Context *context;
+	char **paths;
+	double start, elapsed;
+	int32_t i, j;
+
+	paths = create_scratch_paths(maxCount);
+	randomState = 1;
+
+	for (j = 0; j < maxCount; j += 1)
+	{
+		/* every fourth image repeats an earlier image that isn't a repeat itself */
+		write_image(paths[j], 16, 16, (j % 4 == 3) ? (next_random() % (j / 4 + 1)) * 4 : (uint32_t) j);
+	}
+
+	printf("dedup: Cram_AddFile, 16x16 images, 25%% duplicates\n");
+
+	for (i = 0; i < ARRAY_LENGTH(counts); i += 1)
+	{
+		init_create_info(&createInfo);
+		context = Cram_Init(&createInfo);
+
+		start = get_seconds();
+
+		for (j = 0; j < counts[i]; j += 1)
+		{
+			Cram_AddFile(context, paths[j]);
+		}
+
+		elapsed = get_seconds() - start;
+
+		printf("  %6d images  %8.3f s  %6.0f ns/image\n", counts[i], elapsed, elapsed * 1e9 / counts[i]);
+
+		Cram_Destroy(context);
+	}
+
+	remove_scratch_files(paths, maxCount);
+}
+
+/* Copy: composing full 2048, 4096 and 8192 atlases out of 512x512 tiles.
+ * Equal tiles pack almost instantly, so Cram_Pack is mostly clearing the page and blitting the tiles into it.
+ */
+static void bench_copy(void)
+{
+	static const int32_t dimensions[] = { 2048, 4096, 8192 };
+	int32_t maxCount = (8192 / 512) * (8192 / 512);
+	Cram_ContextCreateInfo createInfo;
+	Cram_Context *context;
+	char **paths;
+	uint8_t *pixelData;
+	int32_t tileCount, width, height;
+	double start, elapsed;
+	int32_t i, j;
+
+	paths = create_scratch_paths(maxCount);
+
+	for (j = 0; j < maxCount; j += 1)
+	{
+		write_image(paths[j], 512, 512, j);
+	}
+
+	printf("copy: Cram_Pack, 512x512 tiles into a full atlas\n");
+
+	for (i = 0; i < ARRAY_LENGTH(dimensions); i += 1)
+	{
+		init_create_info(&createInfo);
+		context = Cram_Init(&createInfo);
+
+		tileCount = (dimensions[i] / 512) * (dimensions[i] / 512);
+
+		for (j = 0; j < tileCount; j += 1)
+		{
+			Cram_AddFile(context, paths[j]);
+		}
+
+		start = get_seconds();
+		Cram_Pack(context);
+		elapsed = get_seconds() - start;
+
+		Cram_GetPixelData(context, &pixelData, &width, &height);
+
+		printf(
+			"  %4dx%-4d  %7.3f s  %6.2f GB/s\n",
+			width,
+			height,
+			elapsed,
+			(double) width * height * 4 / elapsed / 1e9
+		);
+
+		Cram_Destroy(context);
+	}
+
+	remove_scratch_files(paths, maxCount);
+}
+
+/* Engines: every packer engine on the same images.
+ * The times are for the whole Cram_Pack call, size search and page composition included.
+ */
+static void bench_engines(void)
+{
+	static const Cram_PackerType packerTypes[] =
+	{
+		CRAM_PACKER_MAXRECTS,
+		CRAM_PACKER_SKYLINE,
+		CRAM_PACKER_SKYLINE_WASTE_MAP,
+		CRAM_PACKER_GUILLOTINE,
+		CRAM_PACKER_SHELF
+	};
+	static const char *packerNames[] =
+	{
+		"maxrects",
+		"skyline",
+		"skylinewaste",
+		"guillotine",
+		"shelf"
+	};
+	static const int32_t counts[] = { 2000, 8000 };
+	int32_t maxCount = counts[ARRAY_LENGTH(counts) - 1];
+	Cram_ContextCreateInfo createInfo;
+	char **paths;
+	int32_t i, j;
+
+	paths = create_scratch_paths(maxCount);
+	write_random_images(paths, maxCount, 8, 64);
+
+	for (i = 0; i < ARRAY_LENGTH(counts); i += 1)
+	{
+		printf("engines: Cram_Pack, %d images, 8 to 64 px\n", counts[i]);
+
+		for (j = 0; j < ARRAY_LENGTH(packerTypes); j += 1)
+		{
+			init_create_info(&createInfo);
+			createInfo.packerType = packerTypes[j];
+			createInfo.sizeMode = CRAM_SIZE_ANY;
+
+			add_and_pack(&createInfo, packerNames[j], paths, counts[i]);
+		}
+	}
+
+	remove_scratch_files(paths, maxCount);
+}
+
+/* Order: the MaxRects pack orders on a large sprite set, with skyline for reference.
+ * Best fit only runs on a set a tenth the size.
+ */
+static void bench_order(int32_t count)
+{
+	static const Cram_PackOrder packOrders[] =
+	{
+		CRAM_ORDER_BEST_FIT,
+		CRAM_ORDER_MAX_SIDE,
+		CRAM_ORDER_AREA,
+		CRAM_ORDER_PERIMETER
+	};
+	static const char *orderNames[] =
+	{
+		"bestfit",
+		"maxside",
+		"area",
+		"perimeter"
+	};
+	Cram_ContextCreateInfo createInfo;
+	char **paths;
+	int32_t counts[2];
+	int32_t i, j;
+
+	counts[0] = count / 10;
+	counts[1] = count;
+
+	paths = create_scratch_paths(count);
+	write_random_images(paths, count, 4, 31);
+
+	for (i = 0; i < ARRAY_LENGTH(counts); i += 1)
+	{
+		printf("order: Cram_Pack, %d images, 4 to 31 px\n", counts[i]);
+
+		for (j = (i == 0) ? 0 : 1; j < ARRAY_LENGTH(packOrders); j += 1)
+		{
+			init_create_info(&createInfo);
+			createInfo.packOrder = packOrders[j];
+			createInfo.sizeMode = CRAM_SIZE_ANY;
+
+			add_and_pack(&createInfo, orderNames[j], paths, counts[i]);
+		}
+
+		init_create_info(&createInfo);
+		createInfo.packerType = CRAM_PACKER_SKYLINE;
+		createInfo.sizeMode = CRAM_SIZE_ANY;
+
+		add_and_pack(&createInfo, "skyline", paths, counts[i]);
+	}
+
+	remove_scratch_files(paths, count);
+}
+
+/* Sprite-like noise inside a transparent border, so decoding and trimming both have work to do. */
+static void write_noise_image(const char *path, int32_t width, int32_t height)
+{
+	uint8_t *pixels = calloc(width * height, 4);
+	uint32_t value = 0;
+	int32_t x, y;
+
+	for (y = height / 8; y < height - height / 8; y += 1)
+	{
+		for (x = width / 8; x < width - width / 8; x += 1)
+		{
+			/* runs of a few pixels, so it compresses about as well as real art */
+			if ((x - width / 8) % 4 == 0)
+			{
+				value = next_random();
+			}
+
+			pixels[(y * width + x) * 4 + 0] = (uint8_t) value;
+			pixels[(y * width + x) * 4 + 1] = (uint8_t) (value >> 8);
+			pixels[(y * width + x) * 4 + 2] = (uint8_t) (value >> 16);
+			pixels[(y * width + x) * 4 + 3] = 255;
+		}
+	}
+
+	stbi_write_png(path, width, height, 4, pixels, width * 4);
+	free(pixels);
+}
+
+/* Collects the PNGs directly inside a directory. */
+static char** list_png_files(const char *directory, int32_t *pCount)
+{
+	struct dirent *entry;
+	DIR *dir;
+	char **paths = NULL;
+	size_t length;
+	int32_t count = 0;
+	int32_t capacity = 0;
+
+	dir = opendir(directory);
+	if (dir == NULL)
+	{
+		*pCount = 0;
+		return NULL;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		length = strlen(entry->d_name);
+		if (length < 4 || strcmp(entry->d_name + length - 4, ".png") != 0)
+		{
+			continue;
+		}
+
+		if (count == capacity)
+		{
+			capacity = capacity == 0 ? 256 : capacity * 2;
+			paths = realloc(paths, sizeof(char*) * capacity);
+		}
+
+		paths[count] = malloc(MAX_PATH_LENGTH);
+		snprintf(paths[count], MAX_PATH_LENGTH, "%s%c%s", directory, SEPARATOR, entry->d_name);
+		count += 1;
+	}
+
+	closedir(dir);
+
+	*pCount = count;
+	return paths;
+}
+
+/* Takes the files out of the page cache for a cold run.
+ * Drops every cache through /proc/sys/vm/drop_caches when that is writable, which needs root,
+ * otherwise evicts each file with posix_fadvise.
+ * Returns how it was done, or NULL if it can't be done here.
+ */
+static const char* evict_files(char **paths, int32_t count)
+{
+#ifdef __linux__
+	FILE *dropCaches;
+	int fd;
+	int32_t i;
+
+	sync();
+
+	dropCaches = fopen("/proc/sys/vm/drop_caches", "w");
+	if (dropCaches != NULL)
+	{
+		fputs("3", dropCaches);
+		if (fclose(dropCaches) == 0)
+		{
+			return "drop_caches";
+		}
+	}
+
+	for (i = 0; i < count; i += 1)
+	{
+		fd = open(paths[i], O_RDONLY);
+		if (fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+
+	return "posix_fadvise";
+#else
+	return NULL;
+#endif
+}
+
+static double time_add_files(char **paths, int32_t count, uint8_t batch)
+{
+	Cram_ContextCreateInfo createInfo;
+	Cram_Context *context;
+	double start, elapsed;
+	int32_t i;
+
+	init_create_info(&createInfo);
+	createInfo.trim = 1;
+
+	if (batch)
+	{
+		/* one thread per logical processor */
+		createInfo.threadCount = 0;
+	}
+
+	context = Cram_Init(&createInfo);
+
+	start = get_seconds();
+
+	if (batch)
+	{
+		Cram_AddFiles(context, (const char**) paths, count);
+	}
+	else
+	{
+		for (i = 0; i < count; i += 1)
+		{
+			Cram_AddFile(context, paths[i]);
+		}
+	}
+
+	elapsed = get_seconds() - start;
+
+	Cram_Destroy(context);
+
+	return elapsed;
+}
+
+/* Files: reading, decoding and trimming PNGs, with the page cache cold and warm.
+ * Runs on the given directory, or on generated sprites.
+ */
+static void bench_files(const char *directory)
+{
+	static const char *modeNames[] = { "AddFile", "AddFiles" };
+	struct stat fileStat;
+	const char *evictMethod;
+	char **paths;
+	int32_t count;
+	double bytes, elapsed;
+	int32_t i, batch;
+
+	if (directory != NULL)
+	{
+		paths = list_png_files(directory, &count);
+
+		if (count == 0)
+		{
+			printf("files: no PNGs in %s\n", directory);
+			free(paths);
+			return;
+		}
+	}
+	else
+	{
+		count = 4000;
+		paths = create_scratch_paths(count);
+		randomState = 1;
+
+		for (i = 0; i < count; i += 1)
+		{
+			write_noise_image(paths[i], 16 + next_random() % 113, 16 + next_random() % 113);
+		}
+	}
+
+	bytes = 0;
+	for (i = 0; i < count; i += 1)
+	{
+		if (stat(paths[i], &fileStat) == 0)
+		{
+			bytes += (double) fileStat.st_size;
+		}
+	}
+
+	printf("files: %d PNGs, %.1f MB\n", count, bytes / 1e6);
+
+	for (batch = 0; batch < 2; batch += 1)
+	{
+		evictMethod = evict_files(paths, count);
+
+		if (evictMethod != NULL)
+		{
+			elapsed = time_add_files(paths, count, (uint8_t) batch);
+			printf("  %-8s  cold  %7.3f s  %7.1f MB/s  (%s)\n", modeNames[batch], elapsed, bytes / elapsed / 1e6, evictMethod);
+		}
+
+		/* the cold run, or this one, leaves the files cached */
+		time_add_files(paths, count, (uint8_t) batch);
+		elapsed = time_add_files(paths, count, (uint8_t) batch);
+		printf("  %-8s  warm  %7.3f s  %7.1f MB/s\n", modeNames[batch], elapsed, bytes / elapsed / 1e6);
+	}
+
+	if (directory != NULL)
+	{
+		for (i = 0; i < count; i += 1)
+		{
+			free(paths[i]);
+		}
+		free(paths);
+	}
+	else
+	{
+		remove_scratch_files(paths, count);
+	}
+}
+
+static void print_help(void)
+{
+	fprintf(stdout, "Usage: cram_bench [dedup|copy|engines|order [image_count]|files [png_dir]]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *benchmark = (argc > 1) ? argv[1] : NULL;
+	uint8_t ran = 0;
+
+	if (benchmark != NULL && strcmp(benchmark, "--help") == 0)
+	{
+		print_help();
+		return 0;
+	}
+	int32_t imageCount = 80000;
+
+	if (benchmark != NULL && strcmp(benchmark, "order") == 0 && argc > 2)
+	{
+		imageCount = atoi(argv[2]);
+
+		if (imageCount < 10)
+		{
+			print_help();
+			return 1;
+		}
+	}
+
+	if (benchmark == NULL || strcmp(benchmark, "dedup") == 0)
+	{
+		bench_dedup();
+		ran = 1;
+	}
+
+	if (benchmark == NULL || strcmp(benchmark, "copy") == 0)
+	{
+		bench_copy();
+		ran = 1;
+	}
+
+	if (benchmark == NULL || strcmp(benchmark, "engines") == 0)
+	{
+		bench_engines();
+		ran = 1;
+	}
+
+	if (benchmark == NULL || strcmp(benchmark, "order") == 0)
+	{
+		bench_order(imageCount);
+		ran = 1;
+	}
+
+	if (benchmark == NULL || strcmp(benchmark, "files") == 0)
+	{
+		bench_files((benchmark != NULL && argc > 2) ? argv[2] : NULL);
+		ran = 1;
+	}
+
+	if (!ran)
+	{
+		print_help();
+		return 1;
+	}
+
+	return 0;
+}
@@ -35,6 +35,7 @@
 #define CRAMCALL
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef _MSC_VER
@@ -71,9 +72,9 @@ extern "C"
 {
 #endif /* __cplusplus */
 
-#define CRAM_MAJOR_VERSION 1
-#define CRAM_MINOR_VERSION 1
-#define CRAM_PATCH_VERSION 1
+#define CRAM_MAJOR_VERSION 2
+#define CRAM_MINOR_VERSION 0
+#define CRAM_PATCH_VERSION 0
 
 #define CRAM_COMPILED_VERSION ( \
 	(CRAM_MAJOR_VERSION * 100 * 100) + \
@@ -87,18 +88,78 @@ CRAMAPI uint32_t Cram_LinkedVersion(void);
 
 typedef struct Cram_Context Cram_Context;
 
+typedef enum Cram_Heuristic
+{
+	CRAM_HEURISTIC_BEST_AREA_FIT,
+	CRAM_HEURISTIC_BEST_SHORT_SIDE_FIT,
+	CRAM_HEURISTIC_BEST_LONG_SIDE_FIT,
+	CRAM_HEURISTIC_BOTTOM_LEFT,
+	CRAM_HEURISTIC_CONTACT_POINT,
+	CRAM_HEURISTIC_AUTO /* packs with all of the above concurrently and keeps the smallest atlas */
+} Cram_Heuristic;
+
+typedef enum Cram_PackerType
+{
+	CRAM_PACKER_MAXRECTS, /* densest, slows down with very many rects */
+	CRAM_PACKER_SKYLINE, /* bottom-left skyline, close to linear in the rect count */
+	CRAM_PACKER_SKYLINE_WASTE_MAP, /* skyline that also fills the gaps left under it */
+	CRAM_PACKER_GUILLOTINE, /* splits free space in two per placement and merges it back */
+	CRAM_PACKER_SHELF /* shelf next fit, constant time per rect, loosest packing */
+} Cram_PackerType;
+
+/* MaxRects keeps every maximal free rectangle, and each placement walks all of them,
+ * so packing time grows faster than the rect count even in a single pass.
+ * 80000 small sprites take around 15 seconds with CRAM_ORDER_MAX_SIDE.
+ * At that scale CRAM_PACKER_SKYLINE packs in a fraction of a second.
+ */
+typedef enum Cram_PackOrder
+{
+	CRAM_ORDER_BEST_FIT, /* every placement picks the best fitting rect of all those left */
+	CRAM_ORDER_MAX_SIDE, /* the rest sort once, largest first, then go in one pass */
+	CRAM_ORDER_AREA,
+	CRAM_ORDER_PERIMETER
+} Cram_PackOrder;
+
+typedef enum Cram_SizeMode
+{
+	CRAM_SIZE_POWER_OF_TWO,
+	CRAM_SIZE_ANY, /* cropped to the packed images */
+	CRAM_SIZE_MULTIPLE_OF_FOUR, /* cropped, then rounded up for block compression */
+	CRAM_SIZE_SQUARE /* cropped, then the shorter side is extended */
+} Cram_SizeMode;
+
 typedef struct Cram_ContextCreateInfo
 {
 	char *name;
 	uint32_t maxDimension;
 	int32_t padding;
 	uint8_t trim;
+	uint32_t threadCount; /* 0 uses one thread per logical processor */
+	Cram_PackerType packerType;
+	Cram_Heuristic heuristic; /* MaxRects only */
+	Cram_PackOrder packOrder; /* MaxRects only */
+	Cram_SizeMode sizeMode;
+	uint8_t rotate; /* allow images to be rotated 90 degrees clockwise when that packs better */
+	uint8_t multiPage; /* spill over into more pages instead of failing when maxDimension is too small */
+	uint8_t growInPlace; /* grow the atlas around the rects placed so far instead of repacking at every size */
+
+	/* MaxRects only: after the size search, keep repacking with randomized heuristics and orders
+	 * and keep any layout that makes the atlas smaller. Stops after optimizeMilliseconds
+	 * or optimizeRestarts, whichever comes first; 0 means no limit, both 0 turns it off.
+	 * With only a restart limit the result is the same for a given seed and threadCount.
+	 */
+	uint32_t optimizeMilliseconds;
+	uint32_t optimizeRestarts;
+	uint32_t optimizeSeed;
 } Cram_ContextCreateInfo;
 
 typedef struct Cram_ImageData
 {
 	char *path;
 
+	/* The image's region in the atlas. If rotated, the image was turned 90 degrees clockwise,
+	 * so width and height are the trimmed image's height and width.
+	 */
 	int32_t x;
 	int32_t y;
 	int32_t width;
@@ -108,18 +169,145 @@ typedef struct Cram_ImageData
 	int32_t trimOffsetY;
 	int32_t untrimmedWidth;
 	int32_t untrimmedHeight;
+
+	uint8_t rotated;
+	int32_t page;
 } Cram_ImageData;
 
+/* Packer instrumentation for the last Cram_Pack call, summed over every size attempt and heuristic tried. */
+typedef struct Cram_PackStats
+{
+	uint64_t placementCount;
+	uint64_t freeRectangleTotal; /* free list length after each placement, summed */
+	int32_t freeRectanglePeak;
+	uint64_t containmentTestCount;
+} Cram_PackStats;
+
+/* One atlas size tried by the last Cram_Pack call. */
+typedef struct Cram_PackAttempt
+{
+	int32_t width;
+	int32_t height;
+	Cram_Heuristic heuristic;
+	int32_t page;
+	uint8_t success;
+} Cram_PackAttempt;
+
+/* A region of an atlas page, in pixels. */
+typedef struct Cram_Region
+{
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+} Cram_Region;
+
+/* One image moved by Cram_Compact. */
+typedef struct Cram_Move
+{
+	uint32_t handle;
+	Cram_Region source;
+	Cram_Region destination;
+} Cram_Move;
+
+/* Reads an encoded image from a stream, see Cram_AddEncodedFromCallbacks. */
+typedef struct Cram_IOCallbacks
+{
+	int32_t (*read)(void *userdata, char *data, int32_t size); /* returns the number of bytes read */
+	void (*skip)(void *userdata, int32_t n); /* n can be negative to go back */
+	int32_t (*eof)(void *userdata); /* nonzero once the stream is exhausted */
+} Cram_IOCallbacks;
+
 /* API definition */
 
 CRAMAPI Cram_Context* Cram_Init(Cram_ContextCreateInfo *createInfo);
 
+/* Files that can't be read or don't decode are skipped. */
 CRAMAPI void Cram_AddFile(Cram_Context *context, const char *path);
 
+/* Decodes, trims and hashes the files on a worker pool.
+ * The result is identical to calling Cram_AddFile on each path in order.
+ */
+CRAMAPI void Cram_AddFiles(Cram_Context *context, const char **paths, int32_t pathCount);
+
+/* Adds an image that is already in memory, as RGBA32 rows stride bytes apart (0 for width * 4).
+ * name is what Cram_GetMetadata reports as its path.
+ * If borrow is set the pixels aren't copied when added, they are read straight from the buffer,
+ * which must stay valid and unchanged until the next Cram_Pack returns. Cram_Pack copies
+ * the trimmed pixels it needs to keep, so the buffer can be freed afterwards.
+ * Returns -1 if the size or stride is invalid.
+ */
+CRAMAPI int8_t Cram_AddPixels(
+	Cram_Context *context,
+	const char *name,
+	uint8_t *pixels,
+	int32_t width,
+	int32_t height,
+	int32_t stride,
+	uint8_t borrow
+);
+
+/* Decodes a PNG that is already in memory, or read through callbacks, for pak files and the like.
+ * name is what Cram_GetMetadata reports as its path. The data isn't kept after the call.
+ * Returns -1 if the image can't be decoded.
+ */
+CRAMAPI int8_t Cram_AddEncoded(Cram_Context *context, const char *name, const void *data, size_t length);
+CRAMAPI int8_t Cram_AddEncodedFromCallbacks(
+	Cram_Context *context,
+	const char *name,
+	const Cram_IOCallbacks *callbacks,
+	void *userdata
+);
+
+/* Decodes many in-memory PNGs on a worker pool, then adds them in order like Cram_AddEncoded.
+ * Images that don't decode are skipped and make it return -1.
+ */
+CRAMAPI int8_t Cram_AddEncodedBatch(
+	Cram_Context *context,
+	const char **names,
+	const void **data,
+	const size_t *lengths,
+	int32_t count
+);
+
 CRAMAPI int8_t Cram_Pack(Cram_Context *context);
 
+/* Returns the first page. */
 CRAMAPI void Cram_GetPixelData(Cram_Context *context, uint8_t **pPixelData, int32_t *pWidth, int32_t *pHeight);
+CRAMAPI int32_t Cram_GetPageCount(Cram_Context *context);
+CRAMAPI void Cram_GetPagePixelData(Cram_Context *context, int32_t page, uint8_t **pPixelData, int32_t *pWidth, int32_t *pHeight);
 CRAMAPI void Cram_GetMetadata(Cram_Context *context, Cram_ImageData **pImage, int32_t *pImageCount);
+CRAMAPI void Cram_GetPackStats(Cram_Context *context, Cram_PackStats *pStats);
+CRAMAPI void Cram_GetPackAttempts(Cram_Context *context, Cram_PackAttempt **pAttempts, int32_t *pAttemptCount);
+
+/* Live atlas: images are placed on the first page one at a time, without moving anything already there.
+ * Pixels are RGBA32, width * 4 bytes per row. Nothing is trimmed, rotated or de-duplicated.
+ * If nothing has been packed yet, the first page starts small and grows up to maxDimension
+ * as images stop fitting. A page made by Cram_Pack only grows with growInPlace.
+ * When the page grows the dirty region is the whole page.
+ * pDirtyRegion receives the part of the page that changed and needs to be uploaded again, and may be NULL.
+ * Cram_Insert returns 0 if the image doesn't fit. Handles of removed images get reused.
+ * Cram_Pack starts the atlas over, which drops inserted images and invalidates their handles.
+ */
+CRAMAPI uint32_t Cram_Insert(Cram_Context *context, uint8_t *pixels, int32_t width, int32_t height, Cram_Region *pDirtyRegion);
+CRAMAPI int8_t Cram_Remove(Cram_Context *context, uint32_t handle, Cram_Region *pDirtyRegion);
+
+/* Where an inserted image currently is. Returns -1 for an unknown handle. */
+CRAMAPI int8_t Cram_GetRegion(Cram_Context *context, uint32_t handle, Cram_Region *pRegion);
+
+/* Moves inserted images towards the layout they would get if they were all inserted at once,
+ * and rebuilds the free space between them. Images placed by Cram_Pack stay where they are.
+ * The moves are already applied to the page. To mirror them on a GPU copy, apply them in order.
+ * A move's source and destination never overlap, so each one is a single copy within the texture
+ * followed by clearing the source. Images may move more than once, through free space,
+ * when they are in each other's way.
+ * At most moveBudget moves are made, or any number if moveBudget is 0.
+ * Returns 1 if the budget ran out before the compaction finished, or if the free space left by this call's
+ * moves has to be measured again before the next one, so it can be continued next frame.
+ * Returns 0 once no more moves are possible. That is normally the full layout, but if the page is too
+ * full to shuffle images through free space, the rest stay where they are.
+ */
+CRAMAPI int8_t Cram_Compact(Cram_Context *context, int32_t moveBudget, Cram_Move **pMoves, int32_t *pMoveCount);
 
 CRAMAPI void Cram_Destroy(Cram_Context *context);
 
@@ -26,6 +26,34 @@
 
 #include "cram.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CRAM_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CRAM_SSE2
+#endif
+
+#if defined(_MSC_VER) && (defined(CRAM_AVX2) || defined(CRAM_SSE2))
+#include <intrin.h>
+#endif
+
 #define STBI_ONLY_PNG
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -36,6 +64,8 @@
 #define INITIAL_DATA_CAPACITY 8
 #define INITIAL_FREE_RECTANGLE_CAPACITY 16
 #define INITIAL_DIMENSION 32
+#define CONTACT_GRID_CELL_SIZE 32
+#define MMAP_THRESHOLD (64 * 1024) /* smaller files are read with a single pread */
 
 /* Structures */
 
@@ -53,38 +83,117 @@ struct Cram_Image
 	Rect originalRect;
 	Rect trimmedRect;
 	Rect packedRect;
+	uint8_t rotated;
+	int32_t page;
 	Cram_Image *duplicateOf;
 	uint8_t *pixels; /* Will be NULL if duplicateOf is not NULL! */
+	int32_t pixelStride; /* in pixels, the trimmed width unless the pixels are borrowed */
+	uint8_t borrowed; /* pixels point into the caller's buffer until Cram_Pack copies them */
 	size_t hash;
+	Cram_Image *nextWithSameKey; /* chains unique images that share an ImageKey */
 };
 
+/* Must not contain padding, stb_ds hashes and compares keys bytewise. */
+typedef struct Cram_Internal_ImageKey
+{
+	size_t hash;
+	int32_t width;
+	int32_t height;
+} Cram_Internal_ImageKey;
+
+typedef struct Cram_Internal_ImageMapEntry
+{
+	Cram_Internal_ImageKey key;
+	Cram_Image *value;
+} Cram_Internal_ImageMapEntry;
+
+typedef struct Cram_Internal_LiveImage
+{
+	Rect rect; /* as placed in the packer, padding included */
+	int32_t nextFree; /* next unused slot, while this one is unused */
+	uint8_t used;
+} Cram_Internal_LiveImage;
+
+typedef struct Cram_Internal_Page
+{
+	uint8_t *pixels;
+	int32_t width;
+	int32_t height;
+} Cram_Internal_Page;
+
 typedef struct Cram_Internal_Context
 {
 	char *name;
 
 	int32_t padding;
 	uint8_t trim;
-
-	uint8_t *pixels;
+	int32_t threadCount;
+	Cram_PackerType packerType;
+	Cram_Heuristic heuristic;
+	Cram_PackOrder packOrder;
+	Cram_SizeMode sizeMode;
+	uint8_t rotate;
+	uint8_t multiPage;
+	uint8_t growInPlace;
+	uint32_t optimizeMilliseconds;
+	uint32_t optimizeRestarts;
+	uint32_t optimizeSeed;
+
+	Cram_Internal_Page *pages;
+	int32_t pageCount;
 
 	Cram_Image **images;
 	int32_t imageCount;
 	int32_t imageCapacity;
 
+	Cram_Internal_ImageMapEntry *imageMap; /* unique images only */
+
 	Cram_ImageData *imageDatas;
 	int32_t imageDataCount;
 
 	int32_t maxDimension;
 
-	int32_t packedWidth;
-	int32_t packedHeight;
+	Cram_PackStats packStats;
+
+	Cram_PackAttempt *packAttempts;
+	int32_t packAttemptCount;
+	int32_t packAttemptCapacity;
+
+	/* Cram_Insert and Cram_Remove, first page only. Handles are slot index + 1. */
+	struct RectPackContext *livePacker;
+	uint8_t liveGrows; /* the first page grows when an insert doesn't fit */
+	Cram_Internal_LiveImage *liveImages;
+	int32_t liveImageCount;
+	int32_t liveImageCapacity;
+	int32_t firstFreeLiveImage;
+
+	Cram_Move *moves;
+	int32_t moveCount;
+	int32_t moveCapacity;
 } Cram_Internal_Context;
 
+typedef struct FreeRectRef
+{
+	Rect rect;
+	int32_t area;
+	int32_t index; /* into freeRectangles */
+} FreeRectRef;
+
+typedef struct NewFreeRectRef
+{
+	int32_t x;
+	int32_t index; /* into newFreeRectangles */
+} NewFreeRectRef;
+
 typedef struct RectPackContext
 {
 	int32_t width;
 	int32_t height;
 
+	Cram_Heuristic heuristic; /* never CRAM_HEURISTIC_AUTO */
+	Cram_PackOrder packOrder;
+	uint8_t allowRotation;
+
 	Rect *freeRectangles;
 	int32_t freeRectangleCount;
 	int32_t freeRectangleCapacity;
@@ -92,30 +201,371 @@ typedef struct RectPackContext
 	Rect *newFreeRectangles;
 	int32_t newFreeRectangleCount;
 	int32_t newFreeRectangleCapacity;
+
+	/* For the last placement, where each previous free rect ended up (-1 if it was split).
+	 * Free rects from survivorCount onwards were created by that placement.
+	 */
+	int32_t *freeRectangleRemap;
+	int32_t *freeRectangleOrigin;
+	int32_t remapCapacity;
+	int32_t survivorCount;
+
+	/* Free rectangles sorted by ascending area.
+	 * Patched after every placement, rebuilt from scratch after a reset.
+	 */
+	FreeRectRef *sizeIndex;
+	int32_t sizeIndexCapacity;
+	FreeRectRef *newSizeIndexEntries;
+	int32_t newSizeIndexEntryCapacity;
+	uint8_t sizeIndexDirty;
+
+	/* Single-pass packing only: new free rects narrower or shorter than this are dropped,
+	 * since none of the rects left to place would fit in them.
+	 * Free rects on the right or bottom edge are kept because growing the bin widens them.
+	 */
+	int32_t minFreeWidth;
+	int32_t minFreeHeight;
+
+	/* Scratch space for pruning, sized to newFreeRectangleCapacity */
+	NewFreeRectRef *newFreeRectangleRefs;
+	int32_t *newFreeRectangleContainers;
+	int32_t pruneScratchCapacity;
+
+	/* Contact point heuristic only: placed rects, bucketed into a coarse grid for adjacency queries */
+	Rect *usedRectangles;
+	int32_t usedRectangleCount;
+	int32_t usedRectangleCapacity;
+	uint32_t *usedRectangleStamps;
+	uint32_t contactStamp;
+	int32_t **contactGrid; /* stb_ds arrays of usedRectangles indices */
+	int32_t contactGridWidth;
+	int32_t contactGridHeight;
+
+	/* Contact point heuristic only: surviving free rects close enough to the last placement to gain contact */
+	Rect lastPlacedRectangle;
+	int32_t *nearbyFreeRectangles;
+	int32_t nearbyFreeRectangleCount;
+	int32_t nearbyFreeRectangleCapacity;
+
+	/* Instrumentation */
+	uint64_t placementCount;
+	uint64_t freeRectangleTotal;
+	int32_t freeRectanglePeak;
+	uint64_t containmentTestCount;
 } RectPackContext;
 
+/* Free rectangles that never overlap, split guillotine style as they get used */
+typedef struct GuillotineFreeList
+{
+	Rect *rectangles;
+	int32_t count;
+	int32_t capacity;
+
+	/* join free rectangles that share a whole edge as they are added */
+	uint8_t merge;
+} GuillotineFreeList;
+
+typedef struct GuillotinePackContext
+{
+	int32_t width;
+	int32_t height;
+
+	uint8_t allowRotation;
+
+	GuillotineFreeList freeList;
+
+	/* Instrumentation */
+	uint64_t placementCount;
+	uint64_t freeRectangleTotal;
+	int32_t freeRectanglePeak;
+} GuillotinePackContext;
+
+/* Shelf next fit: only the newest shelf is ever open, so every insert is O(1). */
+typedef struct ShelfPackContext
+{
+	int32_t width;
+	int32_t height;
+
+	uint8_t allowRotation;
+
+	int32_t shelfX;
+	int32_t shelfY;
+	int32_t shelfHeight;
+
+	/* Instrumentation */
+	uint64_t placementCount;
+} ShelfPackContext;
+
+typedef struct SkylineNode
+{
+	int32_t x;
+	int32_t y;
+	int32_t width;
+} SkylineNode;
+
+typedef struct SkylinePackContext
+{
+	int32_t width;
+	int32_t height;
+
+	uint8_t allowRotation;
+	uint8_t useWasteMap;
+
+	/* Left to right, covering the whole width */
+	SkylineNode *nodes;
+	int32_t nodeCount;
+	int32_t nodeCapacity;
+
+	/* Waste map only: gaps left under the skyline */
+	GuillotineFreeList wasteMap;
+
+	/* Instrumentation */
+	uint64_t placementCount;
+	uint64_t freeRectangleTotal;
+	int32_t freeRectanglePeak;
+} SkylinePackContext;
+
+/* A packer engine fills in the function pointers and keeps its own state in driverData. */
+typedef struct Cram_Internal_Packer Cram_Internal_Packer;
+
+struct Cram_Internal_Packer
+{
+	void (*Reset)(Cram_Internal_Packer *packer, int32_t width, int32_t height);
+	void (*Grow)(Cram_Internal_Packer *packer, int32_t width, int32_t height); /* keeps the rects placed so far */
+	int8_t (*PackRects)(Cram_Internal_Packer *packer, Rect *rects, int32_t numRects);
+	void (*AddStats)(Cram_Internal_Packer *packer, Cram_PackStats *stats);
+	void (*Destroy)(Cram_Internal_Packer *packer);
+
+	void *driverData;
+
+	int32_t width;
+	int32_t height;
+	Cram_Heuristic heuristic;
+};
+
 typedef struct PackScoreInfo
 {
 	int32_t score;
 	int32_t secondaryScore;
 	int32_t x;
 	int32_t y;
+	int32_t freeRectangleIndex; /* -1 if nothing fits */
+	uint8_t tied; /* another free rect at a different position scores the same */
 } PackScoreInfo;
 
+typedef void (*Cram_Internal_JobFunc)(void *userdata, int32_t index);
+
+typedef struct Cram_Internal_Job
+{
+	Cram_Internal_JobFunc func;
+	void *userdata;
+	int32_t count;
+	volatile int32_t nextIndex;
+} Cram_Internal_Job;
+
+/* One packer per heuristic and concurrently tried size. */
+typedef struct Cram_Internal_PackJob
+{
+	Cram_Internal_Packer **packers;
+	Rect **rects;
+	int32_t *candidates; /* -1 if the packer sits this round out */
+	int8_t *results;
+	Rect *sourceRects;
+	int32_t numRects;
+
+	uint8_t allowRotation;
+
+	/* Size search */
+	Cram_SizeMode sizeMode;
+	int32_t maxDimension;
+	int32_t baseSide; /* non power of two modes only */
+	int32_t sideStep;
+} Cram_Internal_PackJob;
+
+/* The rects that go on one page, and the outcome of packing them. */
+typedef struct Cram_Internal_PagePack
+{
+	int32_t page;
+	Rect *rects;
+	int32_t *rectIndices; /* where each rect came from in Cram_Pack's list */
+	int32_t numRects;
+
+	int8_t result;
+	int32_t width;
+	int32_t height;
+
+	Cram_PackAttempt *attempts;
+	int32_t attemptCount;
+	int32_t attemptCapacity;
+	Cram_PackStats stats;
+} Cram_Internal_PagePack;
+
+typedef struct Cram_Internal_PageJob
+{
+	Cram_Internal_Context *context;
+	Cram_Internal_PagePack *pagePacks;
+} Cram_Internal_PageJob;
+
+/* Forwards stb_image's reads to the caller's callbacks. */
+typedef struct Cram_Internal_IOContext
+{
+	const Cram_IOCallbacks *callbacks;
+	void *userdata;
+} Cram_Internal_IOContext;
+
+typedef struct Cram_Internal_LoadJob
+{
+	Cram_Internal_Context *context;
+	const char **paths;
+	const void **data; /* NULL when loading from paths */
+	const size_t *lengths;
+	Cram_Image **images;
+} Cram_Internal_LoadJob;
+
+/* Threading functions */
+
+static int32_t Cram_Internal_GetProcessorCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	return (int32_t) systemInfo.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int32_t) count : 1;
+#endif
+}
+
+/* Monotonic, only good for measuring intervals. */
+static uint64_t Cram_Internal_GetMilliseconds(void)
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+#endif
+}
+
+/* Returns the value before the increment. */
+static inline int32_t Cram_Internal_AtomicIncrement(volatile int32_t *value)
+{
+#ifdef _WIN32
+	return InterlockedIncrement((volatile LONG*) value) - 1;
+#else
+	return __sync_fetch_and_add(value, 1);
+#endif
+}
+
+static void Cram_Internal_RunJob(Cram_Internal_Job *job)
+{
+	int32_t index;
+
+	while ((index = Cram_Internal_AtomicIncrement(&job->nextIndex)) < job->count)
+	{
+		job->func(job->userdata, index);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Cram_Internal_WorkerThread(LPVOID data)
+{
+	Cram_Internal_RunJob((Cram_Internal_Job*) data);
+	return 0;
+}
+#else
+static void* Cram_Internal_WorkerThread(void *data)
+{
+	Cram_Internal_RunJob((Cram_Internal_Job*) data);
+	return NULL;
+}
+#endif
+
+/* Calls func once for every index in [0, count), spread across up to threadCount threads.
+ * Indices are handed out dynamically, so func must not depend on the order in which they run.
+ */
+static void Cram_Internal_ParallelFor(
+	int32_t threadCount,
+	int32_t count,
+	Cram_Internal_JobFunc func,
+	void *userdata
+) {
+	Cram_Internal_Job job;
+	int32_t workerCount, i;
+#ifdef _WIN32
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+
+	job.func = func;
+	job.userdata = userdata;
+	job.count = count;
+	job.nextIndex = 0;
+
+	workerCount = min(threadCount, count) - 1;
+
+	if (workerCount <= 0)
+	{
+		Cram_Internal_RunJob(&job);
+		return;
+	}
+
+	threads = malloc(sizeof(*threads) * workerCount);
+
+	for (i = 0; i < workerCount; i += 1)
+	{
+#ifdef _WIN32
+		threads[i] = CreateThread(NULL, 0, Cram_Internal_WorkerThread, &job, 0, NULL);
+		if (threads[i] == NULL)
+		{
+			break;
+		}
+#else
+		if (pthread_create(&threads[i], NULL, Cram_Internal_WorkerThread, &job) != 0)
+		{
+			break;
+		}
+#endif
+	}
+	workerCount = i;
+
+	/* the calling thread pitches in too, and since indices are claimed
+	 * dynamically it also picks up the share of any thread that failed to start
+	 */
+	Cram_Internal_RunJob(&job);
+
+	for (i = 0; i < workerCount; i += 1)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+	free(threads);
+}
+
 /* Pixel data functions */
 
 static uint8_t Cram_Internal_IsImageEqual(Cram_Image *a, Cram_Image *b)
 {
-	int32_t i;
+	int32_t j;
 	if (
 		a->hash == b->hash &&
 		a->trimmedRect.w == b->trimmedRect.w &&
 		a->trimmedRect.h == b->trimmedRect.h
 	) {
-		for (i = 0; i < a->trimmedRect.w * a->trimmedRect.h * 4; i += 1)
+		for (j = 0; j < a->trimmedRect.h; j += 1)
 		{
-			if (a->pixels[i] != b->pixels[i])
-			{
+			if (memcmp(
+				&a->pixels[(size_t) j * a->pixelStride * 4],
+				&b->pixels[(size_t) j * b->pixelStride * 4],
+				a->trimmedRect.w * 4
+			) != 0) {
 				return 0;
 			}
 		}
@@ -126,39 +576,206 @@ static uint8_t Cram_Internal_IsImageEqual(Cram_Image *a, Cram_Image *b)
 	return 0;
 }
 
+/* Hashed a row at a time, so borrowed pixels hash the same as a packed copy of them. */
+static size_t Cram_Internal_HashPixels(uint8_t *pixels, int32_t pixelStride, int32_t width, int32_t height)
+{
+	size_t hash = 0;
+	int32_t j;
+
+	for (j = 0; j < height; j += 1)
+	{
+		hash = stbds_hash_bytes(&pixels[(size_t) j * pixelStride * 4], width * 4, hash);
+	}
+
+	return hash;
+}
+
+#if defined(CRAM_AVX2) || defined(CRAM_SSE2)
+
+/* mask must be non-zero */
+static inline int32_t Cram_Internal_LowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int32_t) index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/* mask must be non-zero */
+static inline int32_t Cram_Internal_HighestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return (int32_t) index;
+#else
+	return 31 - __builtin_clz(mask);
+#endif
+}
+
+#endif
+
 static inline int32_t Cram_Internal_GetPixelIndex(int32_t x, int32_t y, int32_t width)
 {
 	return x + y * width;
 }
 
-static uint8_t Cram_Internal_IsRowClear(uint32_t* pixels, int32_t rowIndex, int32_t width)
+#define ALPHA_MASK 0xFF000000
+
+/* Returns the index of the first pixel in [start, end) with non-zero alpha, or end if there is none. */
+static int32_t Cram_Internal_FindFirstOpaque(const uint32_t *row, int32_t start, int32_t end)
 {
-	int32_t i;
+	int32_t i = start;
+	uint32_t clearMask;
 
-	for (i = 0; i < width; i += 1)
+#if defined(CRAM_AVX2)
+	const __m256i alphaMask8 = _mm256_set1_epi32((int32_t) ALPHA_MASK);
+	const __m256i zero8 = _mm256_setzero_si256();
+
+	for (; i + 8 <= end; i += 8)
 	{
-		if ((pixels[Cram_Internal_GetPixelIndex(i, rowIndex, width)] & 0xFF000000) > 0)
+		__m256i alpha = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) &row[i]), alphaMask8);
+		clearMask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(alpha, zero8)));
+
+		if (clearMask != 0xFF)
 		{
-			return 0;
+			return i + Cram_Internal_LowestBit(~clearMask & 0xFF);
 		}
 	}
+#endif
 
-	return 1;
+#if defined(CRAM_SSE2)
+	const __m128i alphaMask4 = _mm_set1_epi32((int32_t) ALPHA_MASK);
+	const __m128i zero4 = _mm_setzero_si128();
+
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i*) &row[i]), alphaMask4);
+		clearMask = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, zero4)));
+
+		if (clearMask != 0xF)
+		{
+			return i + Cram_Internal_LowestBit(~clearMask & 0xF);
+		}
+	}
+#endif
+
+	for (; i < end; i += 1)
+	{
+		if ((row[i] & ALPHA_MASK) > 0)
+		{
+			return i;
+		}
+	}
+
+	return end;
 }
 
-static uint8_t Cram_Internal_IsColumnClear(uint32_t* pixels, int32_t columnIndex, int32_t width, int32_t height)
+/* Returns the index of the last pixel in [start, end) with non-zero alpha, or start - 1 if there is none. */
+static int32_t Cram_Internal_FindLastOpaque(const uint32_t *row, int32_t start, int32_t end)
 {
-	int32_t i;
+	int32_t i = end;
+	uint32_t clearMask;
+
+#if defined(CRAM_AVX2)
+	const __m256i alphaMask8 = _mm256_set1_epi32((int32_t) ALPHA_MASK);
+	const __m256i zero8 = _mm256_setzero_si256();
 
-	for (i = 0; i < height; i += 1)
+	for (; i - 8 >= start; i -= 8)
 	{
-		if ((pixels[Cram_Internal_GetPixelIndex(columnIndex, i, width)] & 0xFF000000) > 0)
+		__m256i alpha = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) &row[i - 8]), alphaMask8);
+		clearMask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(alpha, zero8)));
+
+		if (clearMask != 0xFF)
 		{
-			return 0;
+			return i - 8 + Cram_Internal_HighestBit(~clearMask & 0xFF);
 		}
 	}
+#endif
 
-	return 1;
+#if defined(CRAM_SSE2)
+	const __m128i alphaMask4 = _mm_set1_epi32((int32_t) ALPHA_MASK);
+	const __m128i zero4 = _mm_setzero_si128();
+
+	for (; i - 4 >= start; i -= 4)
+	{
+		__m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i*) &row[i - 4]), alphaMask4);
+		clearMask = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, zero4)));
+
+		if (clearMask != 0xF)
+		{
+			return i - 4 + Cram_Internal_HighestBit(~clearMask & 0xF);
+		}
+	}
+#endif
+
+	for (i -= 1; i >= start; i -= 1)
+	{
+		if ((row[i] & ALPHA_MASK) > 0)
+		{
+			return i;
+		}
+	}
+
+	return start - 1;
+}
+
+/* Computes the bounding box of all pixels with non-zero alpha in a single row-major pass.
+ * If the image is fully transparent the bounds are the whole image.
+ */
+static void Cram_Internal_GetOpaqueBounds(uint32_t *pixels, int32_t width, int32_t height, int32_t pixelStride, Rect *bounds)
+{
+	const uint32_t *row;
+	int32_t left = width;
+	int32_t right = 0;
+	int32_t top = -1;
+	int32_t bottom = 0;
+	int32_t first, last;
+	int32_t y;
+
+	for (y = 0; y < height; y += 1)
+	{
+		row = &pixels[Cram_Internal_GetPixelIndex(0, y, pixelStride)];
+
+		first = Cram_Internal_FindFirstOpaque(row, 0, width);
+		if (first == width)
+		{
+			continue;
+		}
+
+		if (top < 0)
+		{
+			top = y;
+		}
+		bottom = y + 1;
+
+		left = min(left, first);
+
+		/* only pixels beyond the current right bound can widen it */
+		last = Cram_Internal_FindLastOpaque(row, max(first, right), width);
+		if (last >= right)
+		{
+			right = last + 1;
+		}
+	}
+
+	if (top < 0)
+	{
+		bounds->x = 0;
+		bounds->y = 0;
+		bounds->w = width;
+		bounds->h = height;
+	}
+	else
+	{
+		bounds->x = left;
+		bounds->y = top;
+		bounds->w = right - left;
+		bounds->h = bottom - top;
+	}
 }
 
 /* width and height of source and destination rects must be the same! */
@@ -170,21 +787,72 @@ static int8_t Cram_Internal_CopyPixels(
 	Rect *dstRect,
 	Rect *srcRect
 ) {
-	int32_t i, j;
-	int32_t dstPixelIndex, srcPixelIndex;
+	int32_t j;
+	uint32_t *dstRow;
+	uint32_t *srcRow;
 
 	if (dstRect->w != srcRect->w || dstRect->h != srcRect->h)
 	{
 		return -1;
 	}
 
-	for (i = 0; i < dstRect->w; i += 1)
+	/* rows are contiguous in both buffers, so blit a row at a time */
+	dstRow = &dstPixels[Cram_Internal_GetPixelIndex(dstRect->x, dstRect->y, dstPixelWidth)];
+	srcRow = &srcPixels[Cram_Internal_GetPixelIndex(srcRect->x, srcRect->y, srcPixelWidth)];
+
+	for (j = 0; j < dstRect->h; j += 1)
+	{
+		memcpy(dstRow, srcRow, dstRect->w * sizeof(uint32_t));
+		dstRow += dstPixelWidth;
+		srcRow += srcPixelWidth;
+	}
+
+	return 0;
+}
+
+static void Cram_Internal_ClearPixels(
+	uint32_t *dstPixels,
+	uint32_t dstPixelWidth,
+	Rect *dstRect
+) {
+	int32_t j;
+	uint32_t *dstRow = &dstPixels[Cram_Internal_GetPixelIndex(dstRect->x, dstRect->y, dstPixelWidth)];
+
+	for (j = 0; j < dstRect->h; j += 1)
+	{
+		memset(dstRow, 0, dstRect->w * sizeof(uint32_t));
+		dstRow += dstPixelWidth;
+	}
+}
+
+/* Copies a whole image into dstRect turned 90 degrees clockwise. */
+static int8_t Cram_Internal_CopyPixelsRotated(
+	uint32_t *dstPixels,
+	uint32_t dstPixelWidth,
+	uint32_t *srcPixels,
+	uint32_t srcPixelWidth,
+	Rect *dstRect,
+	Rect *srcRect
+) {
+	int32_t i, j;
+	uint32_t *dstRow;
+	uint32_t *srcColumn;
+
+	if (dstRect->w != srcRect->h || dstRect->h != srcRect->w)
+	{
+		return -1;
+	}
+
+	/* destination row j is source column j, read from the bottom up */
+	for (j = 0; j < dstRect->h; j += 1)
 	{
-		for (j = 0; j < dstRect->h; j += 1)
+		dstRow = &dstPixels[Cram_Internal_GetPixelIndex(dstRect->x, dstRect->y + j, dstPixelWidth)];
+		srcColumn = &srcPixels[Cram_Internal_GetPixelIndex(j, srcRect->h - 1, srcPixelWidth)];
+
+		for (i = 0; i < dstRect->w; i += 1)
 		{
-			dstPixelIndex = Cram_Internal_GetPixelIndex(i + dstRect->x, j + dstRect->y, dstPixelWidth);
-			srcPixelIndex = Cram_Internal_GetPixelIndex(i + srcRect->x, j + srcRect->y, srcPixelWidth);
-			dstPixels[dstPixelIndex] = srcPixels[srcPixelIndex];
+			dstRow[i] = *srcColumn;
+			srcColumn -= srcPixelWidth;
 		}
 	}
 
@@ -193,579 +861,4739 @@ static int8_t Cram_Internal_CopyPixels(
 
 /* Packing functions */
 
-RectPackContext* Cram_Internal_InitRectPacker(int32_t width, int32_t height)
+/* Empties the packer so it holds a single free rect covering width x height. */
+void Cram_Internal_ResetRectPacker(RectPackContext *context, int32_t width, int32_t height)
 {
-	RectPackContext *context = malloc(sizeof(RectPackContext));
+	int32_t i;
 
 	context->width = width;
 	context->height = height;
 
-	context->freeRectangleCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
-	context->freeRectangles = malloc(sizeof(Rect) * context->freeRectangleCapacity);
-
 	context->freeRectangles[0].x = 0;
 	context->freeRectangles[0].y = 0;
 	context->freeRectangles[0].w = width;
 	context->freeRectangles[0].h = height;
 	context->freeRectangleCount = 1;
 
-	context->newFreeRectangleCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
-	context->newFreeRectangles = malloc(sizeof(Rect) * context->freeRectangleCapacity);
 	context->newFreeRectangleCount = 0;
 
-	return context;
-}
+	context->sizeIndexDirty = 1;
 
-/* Uses the best area fit heuristic. */
-/* TODO: make the heuristic configurable? */
-void Cram_Internal_Score(
-	RectPackContext *context,
-	int32_t width,
-	int32_t height,
-	PackScoreInfo *scoreInfo
-) {
-	Rect *freeRect;
-	int32_t areaFit;
-	int32_t shortestSide;
-	int32_t i;
+	if (context->heuristic == CRAM_HEURISTIC_CONTACT_POINT)
+	{
+		for (i = 0; i < context->contactGridWidth * context->contactGridHeight; i += 1)
+		{
+			arrfree(context->contactGrid[i]);
+		}
 
-	scoreInfo->score = INT32_MAX;
-	scoreInfo->secondaryScore = INT32_MAX;
+		context->contactGridWidth = (width + CONTACT_GRID_CELL_SIZE - 1) / CONTACT_GRID_CELL_SIZE;
+		context->contactGridHeight = (height + CONTACT_GRID_CELL_SIZE - 1) / CONTACT_GRID_CELL_SIZE;
+		context->contactGrid = realloc(context->contactGrid, sizeof(int32_t*) * context->contactGridWidth * context->contactGridHeight);
+		memset(context->contactGrid, 0, sizeof(int32_t*) * context->contactGridWidth * context->contactGridHeight);
 
-	for (i = 0; i < context->freeRectangleCount; i += 1)
-	{
-		freeRect = &context->freeRectangles[i];
+		context->usedRectangleCount = 0;
+	}
+}
 
-		if (freeRect->w >= width && freeRect->h >= height)
-		{
-			areaFit = freeRect->w * freeRect->h - width * height;
-			shortestSide = min(freeRect->w - width, freeRect->h - height);
+RectPackContext* Cram_Internal_InitRectPacker(int32_t width, int32_t height, Cram_Heuristic heuristic, uint8_t allowRotation)
+{
+	RectPackContext *context = malloc(sizeof(RectPackContext));
 
-			if (areaFit < scoreInfo->score || (areaFit == scoreInfo->score && shortestSide < scoreInfo->secondaryScore))
-			{
-				scoreInfo->score = areaFit;
-				scoreInfo->secondaryScore = shortestSide;
-				scoreInfo->x = freeRect->x;
-				scoreInfo->y = freeRect->y;
-			}
-		}
+	context->heuristic = heuristic;
+	context->packOrder = CRAM_ORDER_BEST_FIT;
+	context->allowRotation = allowRotation;
+
+	context->minFreeWidth = 0;
+	context->minFreeHeight = 0;
+
+	context->freeRectangleCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->freeRectangles = malloc(sizeof(Rect) * context->freeRectangleCapacity);
+
+	context->newFreeRectangleCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->newFreeRectangles = malloc(sizeof(Rect) * context->newFreeRectangleCapacity);
+
+	context->remapCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->freeRectangleRemap = malloc(sizeof(int32_t) * context->remapCapacity);
+	context->freeRectangleOrigin = malloc(sizeof(int32_t) * context->remapCapacity);
+
+	context->sizeIndexCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->sizeIndex = malloc(sizeof(FreeRectRef) * context->sizeIndexCapacity);
+
+	context->newSizeIndexEntryCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->newSizeIndexEntries = malloc(sizeof(FreeRectRef) * context->newSizeIndexEntryCapacity);
+
+	context->pruneScratchCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+	context->newFreeRectangleRefs = malloc(sizeof(NewFreeRectRef) * context->pruneScratchCapacity);
+	context->newFreeRectangleContainers = malloc(sizeof(int32_t) * context->pruneScratchCapacity);
+
+	context->usedRectangles = NULL;
+	context->usedRectangleStamps = NULL;
+	context->usedRectangleCount = 0;
+	context->usedRectangleCapacity = 0;
+	context->contactStamp = 0;
+	context->contactGrid = NULL;
+	context->contactGridWidth = 0;
+	context->contactGridHeight = 0;
+
+	context->nearbyFreeRectangles = NULL;
+	context->nearbyFreeRectangleCount = 0;
+	context->nearbyFreeRectangleCapacity = 0;
+
+	context->placementCount = 0;
+	context->freeRectangleTotal = 0;
+	context->freeRectanglePeak = 0;
+	context->containmentTestCount = 0;
+
+	Cram_Internal_ResetRectPacker(context, width, height);
+
+	return context;
+}
+
+void Cram_Internal_DestroyRectPacker(RectPackContext *context)
+{
+	int32_t i;
+
+	for (i = 0; i < context->contactGridWidth * context->contactGridHeight; i += 1)
+	{
+		arrfree(context->contactGrid[i]);
 	}
+	free(context->contactGrid);
+	free(context->usedRectangles);
+	free(context->usedRectangleStamps);
+	free(context->nearbyFreeRectangles);
+
+	free(context->freeRectangles);
+	free(context->newFreeRectangles);
+	free(context->freeRectangleRemap);
+	free(context->freeRectangleOrigin);
+	free(context->sizeIndex);
+	free(context->newSizeIndexEntries);
+	free(context->newFreeRectangleRefs);
+	free(context->newFreeRectangleContainers);
+	free(context);
 }
 
-/* Check if a contains b */
-static inline uint8_t Cram_Internal_Contains(Rect* a, Rect* b)
+static int Cram_Internal_CompareFreeRectRefArea(const void *a, const void *b)
 {
-	return b->x >= a->x &&
-		b->y >= a->y &&
-		b->x + b->w <= a->x + a->w &&
-		b->y + b->h <= a->y + a->h;
+	int32_t aArea = ((const FreeRectRef*) a)->area;
+	int32_t bArea = ((const FreeRectRef*) b)->area;
+	return (aArea > bArea) - (aArea < bArea);
 }
 
-void Cram_Internal_PruneRects(RectPackContext* context)
+static void Cram_Internal_RebuildSizeIndex(RectPackContext *context)
 {
-	int32_t i, j;
+	FreeRectRef *ref;
+	int32_t i;
+
+	if (context->sizeIndexCapacity < context->freeRectangleCount)
+	{
+		context->sizeIndexCapacity = max(context->sizeIndexCapacity * 2, context->freeRectangleCount);
+		context->sizeIndex = realloc(context->sizeIndex, sizeof(FreeRectRef) * context->sizeIndexCapacity);
+	}
 
 	for (i = 0; i < context->freeRectangleCount; i += 1)
 	{
-		for (j = context->newFreeRectangleCount - 1; j >= 0; j -= 1)
+		ref = &context->sizeIndex[i];
+		ref->rect = context->freeRectangles[i];
+		ref->area = ref->rect.w * ref->rect.h;
+		ref->index = i;
+	}
+
+	qsort(
+		context->sizeIndex,
+		context->freeRectangleCount,
+		sizeof(FreeRectRef),
+		Cram_Internal_CompareFreeRectRefArea
+	);
+
+	context->sizeIndexDirty = 0;
+}
+
+/* Brings the size index up to date after a placement without re-sorting it.
+ * Entries for split rects are dropped, survivors are renumbered,
+ * and the free rects appended from survivorCount onwards are merged in.
+ */
+static void Cram_Internal_UpdateSizeIndex(RectPackContext *context, int32_t previousCount, int32_t survivorCount)
+{
+	FreeRectRef *ref;
+	int32_t newCount = context->freeRectangleCount - survivorCount;
+	int32_t keptCount, readIndex, newIndex, writeIndex;
+	int32_t i;
+
+	if (context->sizeIndexDirty)
+	{
+		return;
+	}
+
+	if (context->sizeIndexCapacity < context->freeRectangleCount)
+	{
+		context->sizeIndexCapacity = max(context->sizeIndexCapacity * 2, context->freeRectangleCount);
+		context->sizeIndex = realloc(context->sizeIndex, sizeof(FreeRectRef) * context->sizeIndexCapacity);
+	}
+
+	if (context->newSizeIndexEntryCapacity < newCount)
+	{
+		context->newSizeIndexEntryCapacity = max(context->newSizeIndexEntryCapacity * 2, newCount);
+		context->newSizeIndexEntries = realloc(context->newSizeIndexEntries, sizeof(FreeRectRef) * context->newSizeIndexEntryCapacity);
+	}
+
+	keptCount = 0;
+	for (i = 0; i < previousCount; i += 1)
+	{
+		ref = &context->sizeIndex[i];
+		ref->index = context->freeRectangleRemap[ref->index];
+
+		if (ref->index >= 0)
 		{
-			if (Cram_Internal_Contains(&context->freeRectangles[i], &context->newFreeRectangles[j]))
-			{
-				/* plug the hole */
-				context->newFreeRectangles[j] = context->newFreeRectangles[context->newFreeRectangleCount - 1];
-				context->newFreeRectangleCount -= 1;
-			}
+			context->sizeIndex[keptCount] = *ref;
+			keptCount += 1;
 		}
 	}
 
-	if (context->freeRectangleCapacity < context->freeRectangleCount + context->newFreeRectangleCount)
+	for (i = 0; i < newCount; i += 1)
 	{
-		context->freeRectangleCapacity = max(context->freeRectangleCapacity * 2, context->freeRectangleCount + context->newFreeRectangleCount);
-		context->freeRectangles = realloc(context->freeRectangles, sizeof(Rect) * context->freeRectangleCapacity);
+		ref = &context->newSizeIndexEntries[i];
+		ref->rect = context->freeRectangles[survivorCount + i];
+		ref->area = ref->rect.w * ref->rect.h;
+		ref->index = survivorCount + i;
 	}
 
-	for (i = 0; i < context->newFreeRectangleCount; i += 1)
+	qsort(
+		context->newSizeIndexEntries,
+		newCount,
+		sizeof(FreeRectRef),
+		Cram_Internal_CompareFreeRectRefArea
+	);
+
+	/* merge from the back so we can do it in place */
+	readIndex = keptCount - 1;
+	newIndex = newCount - 1;
+	for (writeIndex = keptCount + newCount - 1; newIndex >= 0; writeIndex -= 1)
 	{
-		context->freeRectangles[context->freeRectangleCount] = context->newFreeRectangles[i];
-		context->freeRectangleCount += 1;
+		if (readIndex >= 0 && context->sizeIndex[readIndex].area > context->newSizeIndexEntries[newIndex].area)
+		{
+			context->sizeIndex[writeIndex] = context->sizeIndex[readIndex];
+			readIndex -= 1;
+		}
+		else
+		{
+			context->sizeIndex[writeIndex] = context->newSizeIndexEntries[newIndex];
+			newIndex -= 1;
+		}
 	}
+}
 
-	context->newFreeRectangleCount = 0;
+/* Returns the position of the first entry in the size index with at least the given area. */
+static int32_t Cram_Internal_FindSizeIndexLowerBound(RectPackContext *context, int32_t area)
+{
+	int32_t low = 0;
+	int32_t high = context->freeRectangleCount;
+	int32_t mid;
+
+	while (low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if (context->sizeIndex[mid].area < area)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return low;
 }
 
-static inline void Cram_Internal_AddNewFreeRect(RectPackContext *context, Rect rect)
+static inline void Cram_Internal_ResetScore(PackScoreInfo *scoreInfo)
 {
-	int32_t i;
+	scoreInfo->score = INT32_MAX;
+	scoreInfo->secondaryScore = INT32_MAX;
+	scoreInfo->freeRectangleIndex = -1;
+	scoreInfo->tied = 0;
+}
 
-	for (i = context->newFreeRectangleCount - 1; i >= 0; i -= 1)
+/* Ties go to the earliest free rect, same as a linear scan of the list. */
+static inline void Cram_Internal_UpdateScore(
+	PackScoreInfo *scoreInfo,
+	Rect *freeRect,
+	int32_t freeRectangleIndex,
+	int32_t score,
+	int32_t secondaryScore
+) {
+	if (score < scoreInfo->score || (score == scoreInfo->score && secondaryScore < scoreInfo->secondaryScore))
 	{
-		if (Cram_Internal_Contains(&context->newFreeRectangles[i], &rect))
+		scoreInfo->score = score;
+		scoreInfo->secondaryScore = secondaryScore;
+		scoreInfo->x = freeRect->x;
+		scoreInfo->y = freeRect->y;
+		scoreInfo->freeRectangleIndex = freeRectangleIndex;
+		scoreInfo->tied = 0;
+	}
+	else if (score == scoreInfo->score && secondaryScore == scoreInfo->secondaryScore)
+	{
+		if (freeRect->x != scoreInfo->x || freeRect->y != scoreInfo->y)
 		{
-			return;
+			scoreInfo->tied = 1;
 		}
 
-		if (Cram_Internal_Contains(&rect, &context->newFreeRectangles[i]))
+		if (freeRectangleIndex < scoreInfo->freeRectangleIndex)
 		{
-			context->newFreeRectangles[i] = context->newFreeRectangles[context->newFreeRectangleCount - 1];
-			context->newFreeRectangleCount -= 1;
+			scoreInfo->x = freeRect->x;
+			scoreInfo->y = freeRect->y;
+			scoreInfo->freeRectangleIndex = freeRectangleIndex;
 		}
 	}
+}
 
-	if (context->newFreeRectangleCount == context->newFreeRectangleCapacity)
+static inline int32_t Cram_Internal_CommonIntervalLength(int32_t start0, int32_t end0, int32_t start1, int32_t end1)
+{
+	if (end0 < start1 || end1 < start0)
 	{
-		context->newFreeRectangleCapacity *= 2;
-		context->newFreeRectangles = realloc(context->newFreeRectangles, sizeof(Rect) * context->newFreeRectangleCapacity);
+		return 0;
 	}
 
-	context->newFreeRectangles[context->newFreeRectangleCount] = rect;
-	context->newFreeRectangleCount += 1;
+	return min(end0, end1) - max(start0, start1);
 }
 
-uint8_t Cram_Internal_SplitRect(RectPackContext *context, Rect *rect, Rect *freeRect)
+/* Total length of the rect's edges that touch the bin edges or already placed rects. */
+static int32_t Cram_Internal_ContactScore(RectPackContext *context, int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	Rect newRect;
+	Rect *usedRect;
+	int32_t *cell;
+	int32_t cellX, cellY, firstCellX, firstCellY, lastCellX, lastCellY;
+	int32_t score = 0;
+	int32_t i;
 
-	/* Test intersection */
-	if (	rect->x >= freeRect->x + freeRect->w ||
-			rect->y >= freeRect->y + freeRect->h ||
-			rect->x + rect->w <= freeRect->x ||
-			rect->y + rect->h <= freeRect->y	)
+	if (x == 0 || x + width == context->width)
 	{
-		return 0;
+		score += height;
 	}
 
-	/* now we have new free rectangles! */
-	/* NOTE: free rectangles can overlap. */
-
-	if (rect->y < freeRect->y + freeRect->h && rect->y + rect->h > freeRect->y)
+	if (y == 0 || y + height == context->height)
 	{
-		/* Left side */
-		if (rect->x > freeRect->x && rect->x < freeRect->x + freeRect->w)
-		{
-			newRect = *freeRect;
-			newRect.w = rect->x - freeRect->x;
-			Cram_Internal_AddNewFreeRect(context, newRect);
-		}
+		score += width;
+	}
 
-		/* Right side */
-		if (rect->x + rect->w < freeRect->x + freeRect->w)
-		{
-			newRect = *freeRect;
-			newRect.x = rect->x + rect->w;
-			newRect.w = freeRect->x + freeRect->w - (rect->x + rect->w);
-			Cram_Internal_AddNewFreeRect(context, newRect);
-		}
+	/* stamps make sure a rect spanning several cells is only counted once */
+	context->contactStamp += 1;
+	if (context->contactStamp == 0)
+	{
+		memset(context->usedRectangleStamps, 0, sizeof(uint32_t) * context->usedRectangleCapacity);
+		context->contactStamp = 1;
 	}
 
-	if (rect->x < freeRect->x + freeRect->w && rect->x + rect->w > freeRect->x)
+	firstCellX = max(0, (x - 1) / CONTACT_GRID_CELL_SIZE);
+	firstCellY = max(0, (y - 1) / CONTACT_GRID_CELL_SIZE);
+	lastCellX = min(context->contactGridWidth - 1, (x + width) / CONTACT_GRID_CELL_SIZE);
+	lastCellY = min(context->contactGridHeight - 1, (y + height) / CONTACT_GRID_CELL_SIZE);
+
+	for (cellY = firstCellY; cellY <= lastCellY; cellY += 1)
 	{
-		/* Top side */
-		if (rect->y > freeRect->y && rect->y < freeRect->y + freeRect->h)
+		for (cellX = firstCellX; cellX <= lastCellX; cellX += 1)
 		{
-			newRect = *freeRect;
-			newRect.h = rect->y - freeRect->y;
-			Cram_Internal_AddNewFreeRect(context, newRect);
-		}
+			cell = context->contactGrid[Cram_Internal_GetPixelIndex(cellX, cellY, context->contactGridWidth)];
 
-		/* Bottom side */
-		if (rect->y + rect->h < freeRect->y + freeRect->h)
-		{
-			newRect = *freeRect;
-			newRect.y = rect->y + rect->h;
-			newRect.h = freeRect->y + freeRect->h - (rect->y + rect->h);
-			Cram_Internal_AddNewFreeRect(context, newRect);
+			for (i = 0; i < arrlen(cell); i += 1)
+			{
+				if (context->usedRectangleStamps[cell[i]] == context->contactStamp)
+				{
+					continue;
+				}
+				context->usedRectangleStamps[cell[i]] = context->contactStamp;
+
+				usedRect = &context->usedRectangles[cell[i]];
+
+				if (usedRect->x == x + width || usedRect->x + usedRect->w == x)
+				{
+					score += Cram_Internal_CommonIntervalLength(usedRect->y, usedRect->y + usedRect->h, y, y + height);
+				}
+
+				if (usedRect->y == y + height || usedRect->y + usedRect->h == y)
+				{
+					score += Cram_Internal_CommonIntervalLength(usedRect->x, usedRect->x + usedRect->w, x, x + width);
+				}
+			}
 		}
 	}
 
-	return 1;
+	return score;
 }
 
-void Cram_Internal_PlaceRect(RectPackContext *context, Rect *rect)
+static void Cram_Internal_AddUsedRect(RectPackContext *context, Rect *rect)
 {
-	Rect *freeRect;
-	int32_t i;
+	int32_t cellX, cellY, lastCellX, lastCellY;
 
-	for (i = context->freeRectangleCount - 1; i >= 0; i -= 1)
+	if (context->usedRectangleCount == context->usedRectangleCapacity)
 	{
-		freeRect = &context->freeRectangles[i];
+		context->usedRectangleCapacity = max(context->usedRectangleCapacity * 2, INITIAL_FREE_RECTANGLE_CAPACITY);
+		context->usedRectangles = realloc(context->usedRectangles, sizeof(Rect) * context->usedRectangleCapacity);
+		context->usedRectangleStamps = realloc(context->usedRectangleStamps, sizeof(uint32_t) * context->usedRectangleCapacity);
+	}
 
-		if (Cram_Internal_SplitRect(context, rect, freeRect))
+	context->usedRectangles[context->usedRectangleCount] = *rect;
+	context->usedRectangleStamps[context->usedRectangleCount] = 0;
+
+	/* padding can hang over the edge of a cropped page */
+	lastCellX = min((rect->x + rect->w - 1) / CONTACT_GRID_CELL_SIZE, context->contactGridWidth - 1);
+	lastCellY = min((rect->y + rect->h - 1) / CONTACT_GRID_CELL_SIZE, context->contactGridHeight - 1);
+
+	for (cellY = rect->y / CONTACT_GRID_CELL_SIZE; cellY <= lastCellY; cellY += 1)
+	{
+		for (cellX = rect->x / CONTACT_GRID_CELL_SIZE; cellX <= lastCellX; cellX += 1)
 		{
-			/* plug the hole */
-			context->freeRectangles[i] = context->freeRectangles[context->freeRectangleCount - 1];
-			context->freeRectangleCount -= 1;
+			arrput(
+				context->contactGrid[Cram_Internal_GetPixelIndex(cellX, cellY, context->contactGridWidth)],
+				context->usedRectangleCount
+			);
 		}
 	}
 
-	Cram_Internal_PruneRects(context);
+	context->usedRectangleCount += 1;
 }
 
-/* Given rects with width and height, modifies rects with packed x and y positions. */
-int8_t Cram_Internal_PackRects(RectPackContext *context, Rect *rects, int32_t numRects)
-{
-	Rect **rectsToPack = malloc(sizeof(Rect*) * numRects);
-	int32_t rectsToPackCount = numRects;
-	Rect *rectPtr;
-	int32_t bestScore = INT32_MAX;
-	int32_t bestSecondaryScore = INT32_MAX;
-	PackScoreInfo scoreInfo;
-	int32_t bestRectIndex, bestX, bestY;
-	int32_t i, repeat;
+/* Lower scores are better. The rect must fit in the free rect. */
+static inline void Cram_Internal_ScoreFreeRect(
+	RectPackContext *context,
+	Rect *freeRect,
+	int32_t width,
+	int32_t height,
+	int32_t *score,
+	int32_t *secondaryScore
+) {
+	int32_t leftoverWidth = freeRect->w - width;
+	int32_t leftoverHeight = freeRect->h - height;
 
-	for (i = 0; i < numRects; i += 1)
+	switch (context->heuristic)
 	{
-		rectsToPack[i] = &rects[i];
+		case CRAM_HEURISTIC_BEST_SHORT_SIDE_FIT:
+			*score = min(leftoverWidth, leftoverHeight);
+			*secondaryScore = max(leftoverWidth, leftoverHeight);
+			break;
+
+		case CRAM_HEURISTIC_BEST_LONG_SIDE_FIT:
+			*score = max(leftoverWidth, leftoverHeight);
+			*secondaryScore = min(leftoverWidth, leftoverHeight);
+			break;
+
+		case CRAM_HEURISTIC_BOTTOM_LEFT:
+			*score = freeRect->y + height;
+			*secondaryScore = freeRect->x;
+			break;
+
+		case CRAM_HEURISTIC_CONTACT_POINT:
+			*score = -Cram_Internal_ContactScore(context, freeRect->x, freeRect->y, width, height);
+			*secondaryScore = min(leftoverWidth, leftoverHeight);
+			break;
+
+		default:
+			*score = freeRect->w * freeRect->h - width * height;
+			*secondaryScore = min(leftoverWidth, leftoverHeight);
+			break;
 	}
+}
 
-	for (repeat = 0; repeat < numRects; repeat += 1)
+void Cram_Internal_Score(
+	RectPackContext *context,
+	int32_t width,
+	int32_t height,
+	PackScoreInfo *scoreInfo
+) {
+	FreeRectRef *ref;
+	Rect *freeRect;
+	int32_t score, secondaryScore;
+	int32_t i;
+
+	Cram_Internal_ResetScore(scoreInfo);
+
+	if (context->sizeIndexDirty)
 	{
-		bestScore = INT32_MAX;
+		Cram_Internal_RebuildSizeIndex(context);
+	}
 
-		for (i = 0; i < rectsToPackCount; i += 1)
+	/* Free rects smaller in area than the rect can't hold it, so skip straight past them. */
+	i = Cram_Internal_FindSizeIndexLowerBound(context, width * height);
+
+	if (context->heuristic == CRAM_HEURISTIC_BEST_AREA_FIT)
+	{
+		/* Walking in ascending area, the first rect that fits has the best area fit;
+		 * after that we only need to check rects of equal area for the tie breaks.
+		 */
+		for (; i < context->freeRectangleCount; i += 1)
 		{
-			rectPtr = rectsToPack[i];
+			ref = &context->sizeIndex[i];
+			freeRect = &ref->rect;
+			score = ref->area - width * height;
+
+			if (score > scoreInfo->score)
+			{
+				break;
+			}
 
-			 Cram_Internal_Score(context, rectPtr->w, rectPtr->h, &scoreInfo);
+			if (freeRect->w >= width && freeRect->h >= height)
+			{
+				secondaryScore = min(freeRect->w - width, freeRect->h - height);
+				Cram_Internal_UpdateScore(scoreInfo, freeRect, ref->index, score, secondaryScore);
+			}
+		}
+	}
+	else
+	{
+		for (; i < context->freeRectangleCount; i += 1)
+		{
+			ref = &context->sizeIndex[i];
+			freeRect = &ref->rect;
 
-			if (scoreInfo.score < bestScore || (scoreInfo.score == bestScore && scoreInfo.secondaryScore < bestSecondaryScore))
+			if (freeRect->w >= width && freeRect->h >= height)
 			{
-				bestScore = scoreInfo.score;
-				bestSecondaryScore = scoreInfo.secondaryScore;
-				bestRectIndex = i;
-				bestX = scoreInfo.x;
-				bestY = scoreInfo.y;
+				Cram_Internal_ScoreFreeRect(context, freeRect, width, height, &score, &secondaryScore);
+				Cram_Internal_UpdateScore(scoreInfo, freeRect, ref->index, score, secondaryScore);
 			}
 		}
+	}
+}
 
-		if (bestScore == INT32_MAX)
+/* Brings a score from before the last placement up to date.
+ * The old best is still the best of the surviving free rects unless it was split,
+ * or it was tied and the shuffle of the free list may have changed which tie wins.
+ * Otherwise only the free rects the placement created need to be looked at,
+ * plus, for contact point, the survivors next to the placement since only their contact can grow.
+ * Returns 0 if the score has to be recomputed from scratch.
+ */
+static uint8_t Cram_Internal_RefreshScore(
+	RectPackContext *context,
+	int32_t width,
+	int32_t height,
+	PackScoreInfo *scoreInfo
+) {
+	Rect *freeRect, *placedRect;
+	int32_t score, secondaryScore;
+	int32_t i, freeRectangleIndex;
+
+	if (scoreInfo->freeRectangleIndex >= 0)
+	{
+		if (scoreInfo->tied)
 		{
-			/* doesn't fit! abort! */
-			return -1;
+			return 0;
 		}
 
-		rectPtr = rectsToPack[bestRectIndex];
-		rectPtr->x = bestX;
-		rectPtr->y = bestY;
-		Cram_Internal_PlaceRect(context, rectPtr);
+		scoreInfo->freeRectangleIndex = context->freeRectangleRemap[scoreInfo->freeRectangleIndex];
+
+		if (scoreInfo->freeRectangleIndex < 0)
+		{
+			return 0;
+		}
+	}
+
+	if (context->heuristic == CRAM_HEURISTIC_CONTACT_POINT)
+	{
+		placedRect = &context->lastPlacedRectangle;
+
+		for (i = 0; i < context->nearbyFreeRectangleCount; i += 1)
+		{
+			freeRectangleIndex = context->nearbyFreeRectangles[i];
+			freeRect = &context->freeRectangles[freeRectangleIndex];
+
+			if (	freeRect->w >= width &&
+					freeRect->h >= height &&
+					freeRect->x + width >= placedRect->x &&
+					freeRect->y + height >= placedRect->y	)
+			{
+				Cram_Internal_ScoreFreeRect(context, freeRect, width, height, &score, &secondaryScore);
+				Cram_Internal_UpdateScore(scoreInfo, freeRect, freeRectangleIndex, score, secondaryScore);
+			}
+		}
+	}
+
+	for (i = context->survivorCount; i < context->freeRectangleCount; i += 1)
+	{
+		freeRect = &context->freeRectangles[i];
+
+		if (freeRect->w >= width && freeRect->h >= height)
+		{
+			Cram_Internal_ScoreFreeRect(context, freeRect, width, height, &score, &secondaryScore);
+			Cram_Internal_UpdateScore(scoreInfo, freeRect, i, score, secondaryScore);
+		}
+	}
+
+	return 1;
+}
+
+/* Collects the surviving free rects where a rect up to maxWidth x maxHeight could touch the placed rect. */
+static void Cram_Internal_CollectNearbyFreeRects(RectPackContext *context, Rect *placedRect, int32_t maxWidth, int32_t maxHeight)
+{
+	Rect *freeRect;
+	int32_t i;
+
+	context->lastPlacedRectangle = *placedRect;
+	context->nearbyFreeRectangleCount = 0;
+
+	for (i = 0; i < context->survivorCount; i += 1)
+	{
+		freeRect = &context->freeRectangles[i];
+
+		if (	freeRect->x <= placedRect->x + placedRect->w &&
+				freeRect->y <= placedRect->y + placedRect->h &&
+				freeRect->x + maxWidth >= placedRect->x &&
+				freeRect->y + maxHeight >= placedRect->y	)
+		{
+			if (context->nearbyFreeRectangleCount == context->nearbyFreeRectangleCapacity)
+			{
+				context->nearbyFreeRectangleCapacity = max(context->nearbyFreeRectangleCapacity * 2, INITIAL_FREE_RECTANGLE_CAPACITY);
+				context->nearbyFreeRectangles = realloc(context->nearbyFreeRectangles, sizeof(int32_t) * context->nearbyFreeRectangleCapacity);
+			}
+
+			context->nearbyFreeRectangles[context->nearbyFreeRectangleCount] = i;
+			context->nearbyFreeRectangleCount += 1;
+		}
+	}
+}
+
+/* Check if a contains b */
+static inline uint8_t Cram_Internal_Contains(Rect* a, Rect* b)
+{
+	return b->x >= a->x &&
+		b->y >= a->y &&
+		b->x + b->w <= a->x + a->w &&
+		b->y + b->h <= a->y + a->h;
+}
+
+static int Cram_Internal_CompareNewFreeRectRefX(const void *a, const void *b)
+{
+	int32_t aX = ((const NewFreeRectRef*) a)->x;
+	int32_t bX = ((const NewFreeRectRef*) b)->x;
+	return (aX > bX) - (aX < bX);
+}
+
+/* Finds, for each new free rect, the first old free rect that contains it.
+ * New rects are sorted by x so each old rect only visits the ones starting inside its span.
+ * Returns 1 if any new rect is contained.
+ */
+static uint8_t Cram_Internal_FindContainers(RectPackContext *context)
+{
+	NewFreeRectRef *refs = context->newFreeRectangleRefs;
+	int32_t *containers = context->newFreeRectangleContainers;
+	int32_t newCount = context->newFreeRectangleCount;
+	Rect *freeRect, *newRect;
+	int32_t minWidth = INT32_MAX, minHeight = INT32_MAX;
+	int32_t maxLeft = INT32_MIN, maxTop = INT32_MIN;
+	int32_t minRight = INT32_MAX, minBottom = INT32_MAX;
+	int32_t low, high, mid;
+	uint8_t anyContained = 0;
+	int32_t i, j;
+
+	for (j = 0; j < newCount; j += 1)
+	{
+		newRect = &context->newFreeRectangles[j];
+
+		refs[j].x = newRect->x;
+		refs[j].index = j;
+		containers[j] = -1;
+
+		minWidth = min(minWidth, newRect->w);
+		minHeight = min(minHeight, newRect->h);
+		maxLeft = max(maxLeft, newRect->x);
+		maxTop = max(maxTop, newRect->y);
+		minRight = min(minRight, newRect->x + newRect->w);
+		minBottom = min(minBottom, newRect->y + newRect->h);
+	}
+
+	qsort(refs, newCount, sizeof(NewFreeRectRef), Cram_Internal_CompareNewFreeRectRefX);
+
+	for (i = 0; i < context->freeRectangleCount; i += 1)
+	{
+		freeRect = &context->freeRectangles[i];
+
+		/* can't contain any of the new rects */
+		if (	freeRect->w < minWidth ||
+				freeRect->h < minHeight ||
+				freeRect->x > maxLeft ||
+				freeRect->y > maxTop ||
+				freeRect->x + freeRect->w < minRight ||
+				freeRect->y + freeRect->h < minBottom	)
+		{
+			continue;
+		}
+
+		/* first new rect with x >= freeRect->x */
+		low = 0;
+		high = newCount;
+		while (low < high)
+		{
+			mid = low + (high - low) / 2;
+
+			if (refs[mid].x < freeRect->x)
+			{
+				low = mid + 1;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+
+		for (j = low; j < newCount && refs[j].x <= freeRect->x + freeRect->w - minWidth; j += 1)
+		{
+			if (containers[refs[j].index] >= 0)
+			{
+				continue;
+			}
+
+			context->containmentTestCount += 1;
+
+			if (Cram_Internal_Contains(freeRect, &context->newFreeRectangles[refs[j].index]))
+			{
+				containers[refs[j].index] = i;
+				anyContained = 1;
+			}
+		}
+	}
+
+	return anyContained;
+}
+
+void Cram_Internal_PruneRects(RectPackContext* context)
+{
+	int32_t *containers;
+	int32_t container, previousContainer;
+	int32_t i, j;
+
+	if (context->pruneScratchCapacity < context->newFreeRectangleCount)
+	{
+		context->pruneScratchCapacity = max(context->pruneScratchCapacity * 2, context->newFreeRectangleCount);
+		context->newFreeRectangleRefs = realloc(context->newFreeRectangleRefs, sizeof(NewFreeRectRef) * context->pruneScratchCapacity);
+		context->newFreeRectangleContainers = realloc(context->newFreeRectangleContainers, sizeof(int32_t) * context->pruneScratchCapacity);
+	}
+
+	containers = context->newFreeRectangleContainers;
+
+	if (context->newFreeRectangleCount > 0 && Cram_Internal_FindContainers(context))
+	{
+		/* Remove contained rects one container at a time, in container order,
+		 * so the survivors end up in the same order as a pairwise old-by-new sweep would leave them.
+		 */
+		previousContainer = -1;
+		while (1)
+		{
+			container = INT32_MAX;
+			for (j = 0; j < context->newFreeRectangleCount; j += 1)
+			{
+				if (containers[j] > previousContainer && containers[j] < container)
+				{
+					container = containers[j];
+				}
+			}
+
+			if (container == INT32_MAX)
+			{
+				break;
+			}
+
+			for (j = context->newFreeRectangleCount - 1; j >= 0; j -= 1)
+			{
+				if (containers[j] == container)
+				{
+					/* plug the hole */
+					context->newFreeRectangles[j] = context->newFreeRectangles[context->newFreeRectangleCount - 1];
+					containers[j] = containers[context->newFreeRectangleCount - 1];
+					context->newFreeRectangleCount -= 1;
+				}
+			}
+
+			previousContainer = container;
+		}
+	}
+
+	if (context->freeRectangleCapacity < context->freeRectangleCount + context->newFreeRectangleCount)
+	{
+		context->freeRectangleCapacity = max(context->freeRectangleCapacity * 2, context->freeRectangleCount + context->newFreeRectangleCount);
+		context->freeRectangles = realloc(context->freeRectangles, sizeof(Rect) * context->freeRectangleCapacity);
+	}
+
+	for (i = 0; i < context->newFreeRectangleCount; i += 1)
+	{
+		context->freeRectangles[context->freeRectangleCount] = context->newFreeRectangles[i];
+		context->freeRectangleCount += 1;
+	}
+
+	context->newFreeRectangleCount = 0;
+}
+
+static inline void Cram_Internal_AddNewFreeRect(RectPackContext *context, Rect rect)
+{
+	int32_t i;
+
+	if (	(rect.w < context->minFreeWidth || rect.h < context->minFreeHeight) &&
+			rect.x + rect.w < context->width &&
+			rect.y + rect.h < context->height	)
+	{
+		return;
+	}
+
+	for (i = context->newFreeRectangleCount - 1; i >= 0; i -= 1)
+	{
+		context->containmentTestCount += 2;
+
+		if (Cram_Internal_Contains(&context->newFreeRectangles[i], &rect))
+		{
+			return;
+		}
+
+		if (Cram_Internal_Contains(&rect, &context->newFreeRectangles[i]))
+		{
+			context->newFreeRectangles[i] = context->newFreeRectangles[context->newFreeRectangleCount - 1];
+			context->newFreeRectangleCount -= 1;
+		}
+	}
+
+	if (context->newFreeRectangleCount == context->newFreeRectangleCapacity)
+	{
+		context->newFreeRectangleCapacity *= 2;
+		context->newFreeRectangles = realloc(context->newFreeRectangles, sizeof(Rect) * context->newFreeRectangleCapacity);
+	}
+
+	context->newFreeRectangles[context->newFreeRectangleCount] = rect;
+	context->newFreeRectangleCount += 1;
+}
+
+uint8_t Cram_Internal_SplitRect(RectPackContext *context, Rect *rect, Rect *freeRect)
+{
+	Rect newRect;
+
+	/* Test intersection */
+	if (	rect->x >= freeRect->x + freeRect->w ||
+			rect->y >= freeRect->y + freeRect->h ||
+			rect->x + rect->w <= freeRect->x ||
+			rect->y + rect->h <= freeRect->y	)
+	{
+		return 0;
+	}
+
+	/* now we have new free rectangles! */
+	/* NOTE: free rectangles can overlap. */
+
+	if (rect->y < freeRect->y + freeRect->h && rect->y + rect->h > freeRect->y)
+	{
+		/* Left side */
+		if (rect->x > freeRect->x && rect->x < freeRect->x + freeRect->w)
+		{
+			newRect = *freeRect;
+			newRect.w = rect->x - freeRect->x;
+			Cram_Internal_AddNewFreeRect(context, newRect);
+		}
+
+		/* Right side */
+		if (rect->x + rect->w < freeRect->x + freeRect->w)
+		{
+			newRect = *freeRect;
+			newRect.x = rect->x + rect->w;
+			newRect.w = freeRect->x + freeRect->w - (rect->x + rect->w);
+			Cram_Internal_AddNewFreeRect(context, newRect);
+		}
+	}
+
+	if (rect->x < freeRect->x + freeRect->w && rect->x + rect->w > freeRect->x)
+	{
+		/* Top side */
+		if (rect->y > freeRect->y && rect->y < freeRect->y + freeRect->h)
+		{
+			newRect = *freeRect;
+			newRect.h = rect->y - freeRect->y;
+			Cram_Internal_AddNewFreeRect(context, newRect);
+		}
+
+		/* Bottom side */
+		if (rect->y + rect->h < freeRect->y + freeRect->h)
+		{
+			newRect = *freeRect;
+			newRect.y = rect->y + rect->h;
+			newRect.h = freeRect->y + freeRect->h - (rect->y + rect->h);
+			Cram_Internal_AddNewFreeRect(context, newRect);
+		}
+	}
+
+	return 1;
+}
+
+void Cram_Internal_PlaceRect(RectPackContext *context, Rect *rect)
+{
+	Rect *freeRect;
+	int32_t previousCount = context->freeRectangleCount;
+	int32_t survivorCount;
+	int32_t i;
+
+	if (context->remapCapacity < previousCount)
+	{
+		context->remapCapacity = max(context->remapCapacity * 2, previousCount);
+		context->freeRectangleRemap = realloc(context->freeRectangleRemap, sizeof(int32_t) * context->remapCapacity);
+		context->freeRectangleOrigin = realloc(context->freeRectangleOrigin, sizeof(int32_t) * context->remapCapacity);
+	}
+
+	for (i = 0; i < previousCount; i += 1)
+	{
+		context->freeRectangleOrigin[i] = i;
+	}
+
+	for (i = context->freeRectangleCount - 1; i >= 0; i -= 1)
+	{
+		freeRect = &context->freeRectangles[i];
+
+		/* Most free rects are nowhere near the placed rect, so rule those out before the call. */
+		if (	rect->x >= freeRect->x + freeRect->w ||
+				rect->y >= freeRect->y + freeRect->h ||
+				rect->x + rect->w <= freeRect->x ||
+				rect->y + rect->h <= freeRect->y	)
+		{
+			continue;
+		}
+
+		if (Cram_Internal_SplitRect(context, rect, freeRect))
+		{
+			/* plug the hole */
+			context->freeRectangleRemap[context->freeRectangleOrigin[i]] = -1;
+			context->freeRectangleOrigin[i] = context->freeRectangleOrigin[context->freeRectangleCount - 1];
+			context->freeRectangles[i] = context->freeRectangles[context->freeRectangleCount - 1];
+			context->freeRectangleCount -= 1;
+		}
+	}
+
+	survivorCount = context->freeRectangleCount;
+	for (i = 0; i < survivorCount; i += 1)
+	{
+		context->freeRectangleRemap[context->freeRectangleOrigin[i]] = i;
+	}
+	context->survivorCount = survivorCount;
+
+	Cram_Internal_PruneRects(context);
+
+	Cram_Internal_UpdateSizeIndex(context, previousCount, survivorCount);
+
+	if (context->heuristic == CRAM_HEURISTIC_CONTACT_POINT)
+	{
+		Cram_Internal_AddUsedRect(context, rect);
+	}
+
+	context->placementCount += 1;
+	context->freeRectangleTotal += context->freeRectangleCount;
+	context->freeRectanglePeak = max(context->freeRectanglePeak, context->freeRectangleCount);
+}
+
+/* Hands a placed rect's space back to the packer.
+ * The rect becomes a free rect of its own; it isn't joined with the free space around it.
+ */
+void Cram_Internal_ReleaseRect(RectPackContext *context, Rect *rect)
+{
+	int32_t i;
+
+	for (i = context->freeRectangleCount - 1; i >= 0; i -= 1)
+	{
+		context->containmentTestCount += 1;
+
+		if (Cram_Internal_Contains(rect, &context->freeRectangles[i]))
+		{
+			/* plug the hole */
+			context->freeRectangles[i] = context->freeRectangles[context->freeRectangleCount - 1];
+			context->freeRectangleCount -= 1;
+		}
+	}
+
+	if (context->freeRectangleCount == context->freeRectangleCapacity)
+	{
+		context->freeRectangleCapacity *= 2;
+		context->freeRectangles = realloc(context->freeRectangles, sizeof(Rect) * context->freeRectangleCapacity);
+	}
+
+	context->freeRectangles[context->freeRectangleCount] = *rect;
+	context->freeRectangleCount += 1;
+
+	context->sizeIndexDirty = 1;
+}
+
+/* Enlarges the bin without moving anything already placed.
+ * Free rects that ran up against the old right or bottom edge now run up against the new one,
+ * and the newly exposed strips become free rects of their own.
+ */
+void Cram_Internal_GrowRectPacker(RectPackContext *context, int32_t width, int32_t height)
+{
+	Rect *freeRect;
+	Rect usedRect;
+	int32_t usedCount;
+	int32_t i, j;
+
+	for (i = 0; i < context->freeRectangleCount; i += 1)
+	{
+		freeRect = &context->freeRectangles[i];
+
+		if (freeRect->x + freeRect->w == context->width)
+		{
+			freeRect->w = width - freeRect->x;
+		}
+
+		if (freeRect->y + freeRect->h == context->height)
+		{
+			freeRect->h = height - freeRect->y;
+		}
+	}
+
+	if (context->freeRectangleCapacity < context->freeRectangleCount + 2)
+	{
+		context->freeRectangleCapacity = context->freeRectangleCapacity * 2 + 2;
+		context->freeRectangles = realloc(context->freeRectangles, sizeof(Rect) * context->freeRectangleCapacity);
+	}
+
+	if (width > context->width)
+	{
+		freeRect = &context->freeRectangles[context->freeRectangleCount];
+		freeRect->x = context->width;
+		freeRect->y = 0;
+		freeRect->w = width - context->width;
+		freeRect->h = height;
+		context->freeRectangleCount += 1;
+	}
+
+	if (height > context->height)
+	{
+		freeRect = &context->freeRectangles[context->freeRectangleCount];
+		freeRect->x = 0;
+		freeRect->y = context->height;
+		freeRect->w = width;
+		freeRect->h = height - context->height;
+		context->freeRectangleCount += 1;
+	}
+
+	/* Growing is rare, so a plain pairwise prune will do. Of two equal rects the later one goes. */
+	for (i = context->freeRectangleCount - 1; i >= 0; i -= 1)
+	{
+		for (j = 0; j < context->freeRectangleCount; j += 1)
+		{
+			if (j == i)
+			{
+				continue;
+			}
+
+			context->containmentTestCount += 1;
+
+			if (	Cram_Internal_Contains(&context->freeRectangles[j], &context->freeRectangles[i]) &&
+					(j < i || !Cram_Internal_Contains(&context->freeRectangles[i], &context->freeRectangles[j]))	)
+			{
+				/* plug the hole */
+				context->freeRectangles[i] = context->freeRectangles[context->freeRectangleCount - 1];
+				context->freeRectangleCount -= 1;
+				break;
+			}
+		}
+	}
+
+	context->width = width;
+	context->height = height;
+
+	context->sizeIndexDirty = 1;
+
+	if (context->heuristic == CRAM_HEURISTIC_CONTACT_POINT)
+	{
+		/* the grid covers the bin, so it has to be rebuilt */
+		for (i = 0; i < context->contactGridWidth * context->contactGridHeight; i += 1)
+		{
+			arrfree(context->contactGrid[i]);
+		}
+
+		context->contactGridWidth = (width + CONTACT_GRID_CELL_SIZE - 1) / CONTACT_GRID_CELL_SIZE;
+		context->contactGridHeight = (height + CONTACT_GRID_CELL_SIZE - 1) / CONTACT_GRID_CELL_SIZE;
+		context->contactGrid = realloc(context->contactGrid, sizeof(int32_t*) * context->contactGridWidth * context->contactGridHeight);
+		memset(context->contactGrid, 0, sizeof(int32_t*) * context->contactGridWidth * context->contactGridHeight);
+
+		usedCount = context->usedRectangleCount;
+		context->usedRectangleCount = 0;
+
+		for (i = 0; i < usedCount; i += 1)
+		{
+			usedRect = context->usedRectangles[i];
+			Cram_Internal_AddUsedRect(context, &usedRect);
+		}
+	}
+}
+
+static int Cram_Internal_CompareRectSize(const void *a, const void *b)
+{
+	const Rect *rectA = *((const Rect**) a);
+	const Rect *rectB = *((const Rect**) b);
+
+	if (rectA->w != rectB->w)
+	{
+		return (rectA->w > rectB->w) - (rectA->w < rectB->w);
+	}
+
+	return (rectA->h > rectB->h) - (rectA->h < rectB->h);
+}
+
+/* Given rects with width and height, modifies rects with packed x and y positions. */
+int8_t Cram_Internal_PackMaxRects(RectPackContext *context, Rect *rects, int32_t numRects)
+{
+	Rect **rectsToPack = malloc(sizeof(Rect*) * numRects);
+	int32_t *sizeClasses = malloc(sizeof(int32_t) * numRects); /* parallel to rectsToPack */
+	int32_t rectsToPackCount = numRects;
+	Rect *rectPtr;
+	int32_t bestScore = INT32_MAX;
+	int32_t bestSecondaryScore = INT32_MAX;
+	PackScoreInfo *scoreInfo;
+	int32_t bestRectIndex = 0, bestX = 0, bestY = 0;
+	int32_t i, repeat;
+
+	/* Rects of the same size always score the same, so we keep one cached score per distinct size. */
+	Rect **sortedRects = malloc(sizeof(Rect*) * numRects);
+	Rect *classRects = malloc(sizeof(Rect) * numRects);
+	int32_t *classRemaining = malloc(sizeof(int32_t) * numRects);
+	PackScoreInfo *classScores = malloc(sizeof(PackScoreInfo) * numRects);
+	PackScoreInfo *classRotatedScores = malloc(sizeof(PackScoreInfo) * numRects); /* rotation only */
+	int32_t classCount = 0;
+	int32_t maxWidth = 0, maxHeight = 0;
+	uint8_t bestRotated = 0;
+	int32_t swap;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		sortedRects[i] = &rects[i];
+		maxWidth = max(maxWidth, rects[i].w);
+		maxHeight = max(maxHeight, rects[i].h);
+	}
+
+	if (context->allowRotation)
+	{
+		maxWidth = max(maxWidth, maxHeight);
+		maxHeight = maxWidth;
+	}
+
+	qsort(sortedRects, numRects, sizeof(Rect*), Cram_Internal_CompareRectSize);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		if (i == 0 || Cram_Internal_CompareRectSize(&sortedRects[i - 1], &sortedRects[i]) != 0)
+		{
+			classRects[classCount] = *sortedRects[i];
+			classRemaining[classCount] = 0;
+			Cram_Internal_Score(context, sortedRects[i]->w, sortedRects[i]->h, &classScores[classCount]);
+
+			/* a square turned on its side is the same square */
+			if (context->allowRotation && sortedRects[i]->w != sortedRects[i]->h)
+			{
+				Cram_Internal_Score(context, sortedRects[i]->h, sortedRects[i]->w, &classRotatedScores[classCount]);
+			}
+			else
+			{
+				Cram_Internal_ResetScore(&classRotatedScores[classCount]);
+			}
+
+			classCount += 1;
+		}
+
+		classRemaining[classCount - 1] += 1;
+		sizeClasses[sortedRects[i] - rects] = classCount - 1;
+	}
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rectsToPack[i] = &rects[i];
+	}
+
+	free(sortedRects);
+
+	for (repeat = 0; repeat < numRects; repeat += 1)
+	{
+		bestScore = INT32_MAX;
+
+		for (i = 0; i < rectsToPackCount; i += 1)
+		{
+			scoreInfo = &classScores[sizeClasses[i]];
+
+			if (scoreInfo->score < bestScore || (scoreInfo->score == bestScore && scoreInfo->secondaryScore < bestSecondaryScore))
+			{
+				bestScore = scoreInfo->score;
+				bestSecondaryScore = scoreInfo->secondaryScore;
+				bestRectIndex = i;
+				bestX = scoreInfo->x;
+				bestY = scoreInfo->y;
+				bestRotated = 0;
+			}
+
+			if (context->allowRotation)
+			{
+				scoreInfo = &classRotatedScores[sizeClasses[i]];
+
+				if (scoreInfo->score < bestScore || (scoreInfo->score == bestScore && scoreInfo->secondaryScore < bestSecondaryScore))
+				{
+					bestScore = scoreInfo->score;
+					bestSecondaryScore = scoreInfo->secondaryScore;
+					bestRectIndex = i;
+					bestX = scoreInfo->x;
+					bestY = scoreInfo->y;
+					bestRotated = 1;
+				}
+			}
+		}
+
+		if (bestScore == INT32_MAX)
+		{
+			/* doesn't fit! abort! */
+			break;
+		}
+
+		rectPtr = rectsToPack[bestRectIndex];
+		rectPtr->x = bestX;
+		rectPtr->y = bestY;
+
+		if (bestRotated)
+		{
+			swap = rectPtr->w;
+			rectPtr->w = rectPtr->h;
+			rectPtr->h = swap;
+		}
+
+		Cram_Internal_PlaceRect(context, rectPtr);
+
+		if (context->heuristic == CRAM_HEURISTIC_CONTACT_POINT)
+		{
+			Cram_Internal_CollectNearbyFreeRects(context, rectPtr, maxWidth, maxHeight);
+		}
+
+		classRemaining[sizeClasses[bestRectIndex]] -= 1;
+
+		/* plug the hole */
+		rectsToPack[bestRectIndex] = rectsToPack[rectsToPackCount - 1];
+		sizeClasses[bestRectIndex] = sizeClasses[rectsToPackCount - 1];
+		rectsToPackCount -= 1;
+
+		/* the placement only touched part of the free list, so most scores can be patched up */
+		for (i = 0; i < classCount; i += 1)
+		{
+			if (classRemaining[i] > 0)
+			{
+				rectPtr = &classRects[i];
+
+				if (!Cram_Internal_RefreshScore(context, rectPtr->w, rectPtr->h, &classScores[i]))
+				{
+					Cram_Internal_Score(context, rectPtr->w, rectPtr->h, &classScores[i]);
+				}
+
+				if (context->allowRotation && rectPtr->w != rectPtr->h)
+				{
+					if (!Cram_Internal_RefreshScore(context, rectPtr->h, rectPtr->w, &classRotatedScores[i]))
+					{
+						Cram_Internal_Score(context, rectPtr->h, rectPtr->w, &classRotatedScores[i]);
+					}
+				}
+			}
+		}
+	}
+
+	free(rectsToPack);
+	free(sizeClasses);
+	free(classRects);
+	free(classRemaining);
+	free(classScores);
+	free(classRotatedScores);
+
+	return rectsToPackCount == 0 ? 0 : -1;
+}
+
+static int32_t Cram_Internal_GetOrderKey(Cram_PackOrder packOrder, Rect *rect)
+{
+	switch (packOrder)
+	{
+		case CRAM_ORDER_AREA:
+			return rect->w * rect->h;
+
+		case CRAM_ORDER_PERIMETER:
+			return rect->w + rect->h;
+
+		default:
+			return max(rect->w, rect->h);
+	}
+}
+
+/* qsort has no context argument, so the key is computed up front */
+typedef struct OrderedRect
+{
+	int32_t key;
+	int32_t index;
+	Rect *rect;
+} OrderedRect;
+
+static int Cram_Internal_CompareOrderedRects(const void *a, const void *b)
+{
+	const OrderedRect *rectA = (const OrderedRect*) a;
+	const OrderedRect *rectB = (const OrderedRect*) b;
+
+	if (rectA->key != rectB->key)
+	{
+		return (rectA->key < rectB->key) - (rectA->key > rectB->key);
+	}
+
+	return (rectA->index > rectB->index) - (rectA->index < rectB->index);
+}
+
+/* Sorts the rects once by their keys, largest first, and places each one where it fits best.
+ * Each placement only scores one rect, so this is O(n * free rects) against best fit's repeated rescoring.
+ * Free rects too thin for the smallest rect are dropped as they are made, which keeps the free list short.
+ * Rects that don't fit are skipped.
+ */
+static int8_t Cram_Internal_PackMaxRectsInOrder(RectPackContext *context, OrderedRect *orderedRects, int32_t numRects)
+{
+	PackScoreInfo scoreInfo, rotatedScoreInfo;
+	Rect *rect;
+	int32_t swap, i;
+	int8_t result = 0;
+
+	qsort(orderedRects, numRects, sizeof(OrderedRect), Cram_Internal_CompareOrderedRects);
+
+	context->minFreeWidth = INT32_MAX;
+	context->minFreeHeight = INT32_MAX;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rect = orderedRects[i].rect;
+
+		if (context->allowRotation)
+		{
+			context->minFreeWidth = min(context->minFreeWidth, min(rect->w, rect->h));
+			context->minFreeHeight = context->minFreeWidth;
+		}
+		else
+		{
+			context->minFreeWidth = min(context->minFreeWidth, rect->w);
+			context->minFreeHeight = min(context->minFreeHeight, rect->h);
+		}
+	}
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rect = orderedRects[i].rect;
+
+		Cram_Internal_Score(context, rect->w, rect->h, &scoreInfo);
+
+		if (context->allowRotation && rect->w != rect->h)
+		{
+			Cram_Internal_Score(context, rect->h, rect->w, &rotatedScoreInfo);
+
+			if (	rotatedScoreInfo.score < scoreInfo.score ||
+					(rotatedScoreInfo.score == scoreInfo.score && rotatedScoreInfo.secondaryScore < scoreInfo.secondaryScore)	)
+			{
+				scoreInfo = rotatedScoreInfo;
+
+				swap = rect->w;
+				rect->w = rect->h;
+				rect->h = swap;
+			}
+		}
+
+		if (scoreInfo.freeRectangleIndex < 0)
+		{
+			result = -1;
+			continue;
+		}
+
+		rect->x = scoreInfo.x;
+		rect->y = scoreInfo.y;
+
+		Cram_Internal_PlaceRect(context, rect);
+	}
+
+	context->minFreeWidth = 0;
+	context->minFreeHeight = 0;
+
+	return result;
+}
+
+int8_t Cram_Internal_PackMaxRectsSorted(RectPackContext *context, Rect *rects, int32_t numRects)
+{
+	OrderedRect *orderedRects = malloc(sizeof(OrderedRect) * numRects);
+	int8_t result;
+	int32_t i;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		orderedRects[i].key = Cram_Internal_GetOrderKey(context->packOrder, &rects[i]);
+		orderedRects[i].index = i;
+		orderedRects[i].rect = &rects[i];
+	}
+
+	result = Cram_Internal_PackMaxRectsInOrder(context, orderedRects, numRects);
+
+	free(orderedRects);
+
+	return result;
+}
+
+/* MaxRects engine */
+
+static void Cram_Internal_MaxRects_Reset(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	packer->width = width;
+	packer->height = height;
+	Cram_Internal_ResetRectPacker((RectPackContext*) packer->driverData, width, height);
+}
+
+static void Cram_Internal_MaxRects_Grow(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	packer->width = width;
+	packer->height = height;
+	Cram_Internal_GrowRectPacker((RectPackContext*) packer->driverData, width, height);
+}
+
+static int8_t Cram_Internal_MaxRects_PackRects(Cram_Internal_Packer *packer, Rect *rects, int32_t numRects)
+{
+	RectPackContext *context = (RectPackContext*) packer->driverData;
+
+	if (context->packOrder != CRAM_ORDER_BEST_FIT)
+	{
+		return Cram_Internal_PackMaxRectsSorted(context, rects, numRects);
+	}
+
+	return Cram_Internal_PackMaxRects(context, rects, numRects);
+}
+
+static void Cram_Internal_MaxRects_AddStats(Cram_Internal_Packer *packer, Cram_PackStats *stats)
+{
+	RectPackContext *context = (RectPackContext*) packer->driverData;
+
+	stats->placementCount += context->placementCount;
+	stats->freeRectangleTotal += context->freeRectangleTotal;
+	stats->freeRectanglePeak = max(stats->freeRectanglePeak, context->freeRectanglePeak);
+	stats->containmentTestCount += context->containmentTestCount;
+}
+
+static void Cram_Internal_MaxRects_Destroy(Cram_Internal_Packer *packer)
+{
+	Cram_Internal_DestroyRectPacker((RectPackContext*) packer->driverData);
+	free(packer);
+}
+
+static Cram_Internal_Packer* Cram_Internal_MaxRects_Create(
+	int32_t width,
+	int32_t height,
+	Cram_Heuristic heuristic,
+	Cram_PackOrder packOrder,
+	uint8_t allowRotation
+)
+{
+	Cram_Internal_Packer *packer = malloc(sizeof(Cram_Internal_Packer));
+
+	packer->Reset = Cram_Internal_MaxRects_Reset;
+	packer->Grow = Cram_Internal_MaxRects_Grow;
+	packer->PackRects = Cram_Internal_MaxRects_PackRects;
+	packer->AddStats = Cram_Internal_MaxRects_AddStats;
+	packer->Destroy = Cram_Internal_MaxRects_Destroy;
+
+	packer->driverData = Cram_Internal_InitRectPacker(width, height, heuristic, allowRotation);
+	((RectPackContext*) packer->driverData)->packOrder = packOrder;
+	packer->width = width;
+	packer->height = height;
+	packer->heuristic = heuristic;
+
+	return packer;
+}
+
+/* Guillotine free list */
+
+static void Cram_Internal_GuillotineFreeList_Add(GuillotineFreeList *freeList, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	Rect *freeRect;
+	int32_t i;
+
+	if (width <= 0 || height <= 0)
+	{
+		return;
+	}
+
+	if (freeList->merge)
+	{
+		i = 0;
+		while (i < freeList->count)
+		{
+			freeRect = &freeList->rectangles[i];
+
+			if (freeRect->x == x && freeRect->w == width && (freeRect->y + freeRect->h == y || y + height == freeRect->y))
+			{
+				y = min(y, freeRect->y);
+				height += freeRect->h;
+			}
+			else if (freeRect->y == y && freeRect->h == height && (freeRect->x + freeRect->w == x || x + width == freeRect->x))
+			{
+				x = min(x, freeRect->x);
+				width += freeRect->w;
+			}
+			else
+			{
+				i += 1;
+				continue;
+			}
+
+			/* the grown rect may now line up with one we already passed */
+			freeList->rectangles[i] = freeList->rectangles[freeList->count - 1];
+			freeList->count -= 1;
+			i = 0;
+		}
+	}
+
+	if (freeList->count == freeList->capacity)
+	{
+		freeList->capacity = max(freeList->capacity * 2, INITIAL_FREE_RECTANGLE_CAPACITY);
+		freeList->rectangles = realloc(freeList->rectangles, sizeof(Rect) * freeList->capacity);
+	}
+
+	freeRect = &freeList->rectangles[freeList->count];
+	freeRect->x = x;
+	freeRect->y = y;
+	freeRect->w = width;
+	freeRect->h = height;
+
+	freeList->count += 1;
+}
+
+/* Best area fit into the free list. On success the used rect is split along its shorter leftover side. */
+static uint8_t Cram_Internal_GuillotineFreeList_Place(GuillotineFreeList *freeList, uint8_t allowRotation, Rect *rect)
+{
+	Rect freeRect;
+	Rect *candidate;
+	int32_t bestIndex = -1;
+	int32_t bestScore = INT32_MAX;
+	int32_t score, width, height, i;
+	uint8_t rotated = 0;
+
+	for (i = 0; i < freeList->count; i += 1)
+	{
+		candidate = &freeList->rectangles[i];
+		score = candidate->w * candidate->h - rect->w * rect->h;
+
+		if (score >= bestScore)
+		{
+			continue;
+		}
+
+		if (candidate->w >= rect->w && candidate->h >= rect->h)
+		{
+			bestIndex = i;
+			bestScore = score;
+			rotated = 0;
+		}
+		else if (allowRotation && candidate->w >= rect->h && candidate->h >= rect->w)
+		{
+			bestIndex = i;
+			bestScore = score;
+			rotated = 1;
+		}
+	}
+
+	if (bestIndex < 0)
+	{
+		return 0;
+	}
+
+	if (rotated)
+	{
+		width = rect->w;
+		rect->w = rect->h;
+		rect->h = width;
+	}
+
+	freeRect = freeList->rectangles[bestIndex];
+
+	/* plug the hole */
+	freeList->rectangles[bestIndex] = freeList->rectangles[freeList->count - 1];
+	freeList->count -= 1;
+
+	rect->x = freeRect.x;
+	rect->y = freeRect.y;
+
+	width = freeRect.w - rect->w;
+	height = freeRect.h - rect->h;
+
+	if (width < height)
+	{
+		Cram_Internal_GuillotineFreeList_Add(freeList, freeRect.x + rect->w, freeRect.y, width, rect->h);
+		Cram_Internal_GuillotineFreeList_Add(freeList, freeRect.x, freeRect.y + rect->h, freeRect.w, height);
+	}
+	else
+	{
+		Cram_Internal_GuillotineFreeList_Add(freeList, freeRect.x + rect->w, freeRect.y, width, freeRect.h);
+		Cram_Internal_GuillotineFreeList_Add(freeList, freeRect.x, freeRect.y + rect->h, rect->w, height);
+	}
+
+	return 1;
+}
+
+/* Skyline engine */
+
+static void Cram_Internal_Skyline_Reset(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	SkylinePackContext *context = (SkylinePackContext*) packer->driverData;
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+
+	context->nodes[0].x = 0;
+	context->nodes[0].y = 0;
+	context->nodes[0].width = width;
+	context->nodeCount = 1;
+
+	context->wasteMap.count = 0;
+}
+
+/* Returns the lowest y where a width x height rect fits with its left edge on the given node, or -1. */
+static int32_t Cram_Internal_Skyline_Fit(SkylinePackContext *context, int32_t index, int32_t width, int32_t height)
+{
+	int32_t y = 0;
+	int32_t remaining = width;
+
+	if (context->nodes[index].x + width > context->width)
+	{
+		return -1;
+	}
+
+	/* the nodes cover the whole width, so this can't run off the end */
+	while (remaining > 0)
+	{
+		y = max(y, context->nodes[index].y);
+
+		if (y + height > context->height)
+		{
+			return -1;
+		}
+
+		remaining -= context->nodes[index].width;
+		index += 1;
+	}
+
+	return y;
+}
+
+static void Cram_Internal_Skyline_InsertNode(SkylinePackContext *context, int32_t index, int32_t x, int32_t y, int32_t width)
+{
+	if (context->nodeCount == context->nodeCapacity)
+	{
+		context->nodeCapacity *= 2;
+		context->nodes = realloc(context->nodes, sizeof(SkylineNode) * context->nodeCapacity);
+	}
+
+	memmove(&context->nodes[index + 1], &context->nodes[index], sizeof(SkylineNode) * (context->nodeCount - index));
+
+	context->nodes[index].x = x;
+	context->nodes[index].y = y;
+	context->nodes[index].width = width;
+
+	context->nodeCount += 1;
+}
+
+static void Cram_Internal_Skyline_RemoveNode(SkylinePackContext *context, int32_t index)
+{
+	memmove(&context->nodes[index], &context->nodes[index + 1], sizeof(SkylineNode) * (context->nodeCount - index - 1));
+	context->nodeCount -= 1;
+}
+
+/* Raises the skyline over a rect placed on the given node. */
+static void Cram_Internal_Skyline_PlaceRect(SkylinePackContext *context, int32_t index, Rect *rect)
+{
+	SkylineNode *node;
+	int32_t shrink, i;
+
+	if (context->useWasteMap)
+	{
+		/* whatever is under the rect and not already covered becomes waste */
+		for (i = index; i < context->nodeCount && context->nodes[i].x < rect->x + rect->w; i += 1)
+		{
+			node = &context->nodes[i];
+
+			Cram_Internal_GuillotineFreeList_Add(
+				&context->wasteMap,
+				node->x,
+				node->y,
+				min(node->x + node->width, rect->x + rect->w) - node->x,
+				rect->y - node->y
+			);
+		}
+	}
+
+	Cram_Internal_Skyline_InsertNode(context, index, rect->x, rect->y + rect->h, rect->w);
+
+	/* the nodes the rect now covers shrink or disappear */
+	i = index + 1;
+	while (i < context->nodeCount)
+	{
+		node = &context->nodes[i];
+		shrink = context->nodes[i - 1].x + context->nodes[i - 1].width - node->x;
+
+		if (shrink <= 0)
+		{
+			break;
+		}
+
+		node->x += shrink;
+		node->width -= shrink;
+
+		if (node->width > 0)
+		{
+			break;
+		}
+
+		Cram_Internal_Skyline_RemoveNode(context, i);
+	}
+
+	/* only the new node's neighbours can have ended up level with it */
+	if (index + 1 < context->nodeCount && context->nodes[index + 1].y == context->nodes[index].y)
+	{
+		context->nodes[index].width += context->nodes[index + 1].width;
+		Cram_Internal_Skyline_RemoveNode(context, index + 1);
+	}
+
+	if (index > 0 && context->nodes[index - 1].y == context->nodes[index].y)
+	{
+		context->nodes[index - 1].width += context->nodes[index].width;
+		Cram_Internal_Skyline_RemoveNode(context, index);
+	}
+}
+
+static void Cram_Internal_Skyline_Grow(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	SkylinePackContext *context = (SkylinePackContext*) packer->driverData;
+	SkylineNode *lastNode = &context->nodes[context->nodeCount - 1];
+
+	if (width > context->width)
+	{
+		if (lastNode->y == 0)
+		{
+			lastNode->width += width - context->width;
+		}
+		else
+		{
+			Cram_Internal_Skyline_InsertNode(context, context->nodeCount, context->width, 0, width - context->width);
+		}
+	}
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+}
+
+/* Tallest first, then widest. Ties fall back to input order so the layout doesn't depend on qsort. */
+static int Cram_Internal_Skyline_CompareRects(const void *a, const void *b)
+{
+	Rect *rectA = *((Rect**) a);
+	Rect *rectB = *((Rect**) b);
+
+	if (rectA->h != rectB->h)
+	{
+		return rectB->h - rectA->h;
+	}
+
+	if (rectA->w != rectB->w)
+	{
+		return rectB->w - rectA->w;
+	}
+
+	return (rectA > rectB) - (rectA < rectB);
+}
+
+/* Places the rects one at a time, bottom-left first. Rects that don't fit are skipped, leaving x and y alone. */
+static int8_t Cram_Internal_Skyline_PackRects(Cram_Internal_Packer *packer, Rect *rects, int32_t numRects)
+{
+	SkylinePackContext *context = (SkylinePackContext*) packer->driverData;
+	Rect **sortedRects = malloc(sizeof(Rect*) * numRects);
+	Rect *rect;
+	int32_t bestIndex, bestTop, bestWidth, bestY, y, width, height, i, j, k;
+	uint8_t bestRotated;
+	int8_t result = 0;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		sortedRects[i] = &rects[i];
+	}
+
+	qsort(sortedRects, numRects, sizeof(Rect*), Cram_Internal_Skyline_CompareRects);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rect = sortedRects[i];
+
+		if (context->useWasteMap && Cram_Internal_GuillotineFreeList_Place(&context->wasteMap, context->allowRotation, rect))
+		{
+			context->placementCount += 1;
+			continue;
+		}
+
+		bestIndex = -1;
+		bestTop = INT32_MAX;
+		bestWidth = INT32_MAX;
+		bestY = 0;
+		bestRotated = 0;
+
+		for (j = 0; j < context->nodeCount; j += 1)
+		{
+			for (k = 0; k < (context->allowRotation && rect->w != rect->h ? 2 : 1); k += 1)
+			{
+				width = k ? rect->h : rect->w;
+				height = k ? rect->w : rect->h;
+
+				y = Cram_Internal_Skyline_Fit(context, j, width, height);
+
+				if (	y >= 0 &&
+						(	y + height < bestTop ||
+							(y + height == bestTop && context->nodes[j].width < bestWidth)	)	)
+				{
+					bestIndex = j;
+					bestTop = y + height;
+					bestWidth = context->nodes[j].width;
+					bestY = y;
+					bestRotated = k;
+				}
+			}
+		}
+
+		if (bestIndex < 0)
+		{
+			result = -1;
+			continue;
+		}
+
+		if (bestRotated)
+		{
+			width = rect->w;
+			rect->w = rect->h;
+			rect->h = width;
+		}
+
+		rect->x = context->nodes[bestIndex].x;
+		rect->y = bestY;
+
+		Cram_Internal_Skyline_PlaceRect(context, bestIndex, rect);
+
+		context->placementCount += 1;
+		context->freeRectangleTotal += context->nodeCount + context->wasteMap.count;
+		context->freeRectanglePeak = max(context->freeRectanglePeak, context->nodeCount + context->wasteMap.count);
+	}
+
+	free(sortedRects);
+
+	return result;
+}
+
+static void Cram_Internal_Skyline_AddStats(Cram_Internal_Packer *packer, Cram_PackStats *stats)
+{
+	SkylinePackContext *context = (SkylinePackContext*) packer->driverData;
+
+	stats->placementCount += context->placementCount;
+	stats->freeRectangleTotal += context->freeRectangleTotal;
+	stats->freeRectanglePeak = max(stats->freeRectanglePeak, context->freeRectanglePeak);
+}
+
+static void Cram_Internal_Skyline_Destroy(Cram_Internal_Packer *packer)
+{
+	SkylinePackContext *context = (SkylinePackContext*) packer->driverData;
+
+	free(context->nodes);
+	free(context->wasteMap.rectangles);
+	free(context);
+	free(packer);
+}
+
+static Cram_Internal_Packer* Cram_Internal_Skyline_Create(int32_t width, int32_t height, uint8_t allowRotation, uint8_t useWasteMap)
+{
+	Cram_Internal_Packer *packer = malloc(sizeof(Cram_Internal_Packer));
+	SkylinePackContext *context = malloc(sizeof(SkylinePackContext));
+
+	packer->Reset = Cram_Internal_Skyline_Reset;
+	packer->Grow = Cram_Internal_Skyline_Grow;
+	packer->PackRects = Cram_Internal_Skyline_PackRects;
+	packer->AddStats = Cram_Internal_Skyline_AddStats;
+	packer->Destroy = Cram_Internal_Skyline_Destroy;
+
+	packer->driverData = context;
+	packer->heuristic = CRAM_HEURISTIC_BOTTOM_LEFT;
+
+	context->allowRotation = allowRotation;
+	context->useWasteMap = useWasteMap;
+
+	context->nodes = malloc(sizeof(SkylineNode) * INITIAL_FREE_RECTANGLE_CAPACITY);
+	context->nodeCapacity = INITIAL_FREE_RECTANGLE_CAPACITY;
+
+	context->wasteMap.rectangles = NULL;
+	context->wasteMap.capacity = 0;
+	context->wasteMap.merge = 0;
+
+	context->placementCount = 0;
+	context->freeRectangleTotal = 0;
+	context->freeRectanglePeak = 0;
+
+	Cram_Internal_Skyline_Reset(packer, width, height);
+
+	return packer;
+}
+
+/* Guillotine engine */
+
+static void Cram_Internal_Guillotine_Reset(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	GuillotinePackContext *context = (GuillotinePackContext*) packer->driverData;
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+
+	context->freeList.count = 0;
+	Cram_Internal_GuillotineFreeList_Add(&context->freeList, 0, 0, width, height);
+}
+
+static void Cram_Internal_Guillotine_Grow(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	GuillotinePackContext *context = (GuillotinePackContext*) packer->driverData;
+
+	Cram_Internal_GuillotineFreeList_Add(&context->freeList, context->width, 0, width - context->width, height);
+	Cram_Internal_GuillotineFreeList_Add(&context->freeList, 0, context->height, context->width, height - context->height);
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+}
+
+/* Largest area first. Ties fall back to input order so the layout doesn't depend on qsort. */
+static int Cram_Internal_Guillotine_CompareRects(const void *a, const void *b)
+{
+	Rect *rectA = *((Rect**) a);
+	Rect *rectB = *((Rect**) b);
+	int32_t areaA = rectA->w * rectA->h;
+	int32_t areaB = rectB->w * rectB->h;
+
+	if (areaA != areaB)
+	{
+		return areaB - areaA;
+	}
+
+	return (rectA > rectB) - (rectA < rectB);
+}
+
+static int8_t Cram_Internal_Guillotine_PackRects(Cram_Internal_Packer *packer, Rect *rects, int32_t numRects)
+{
+	GuillotinePackContext *context = (GuillotinePackContext*) packer->driverData;
+	Rect **sortedRects = malloc(sizeof(Rect*) * numRects);
+	int32_t i;
+	int8_t result = 0;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		sortedRects[i] = &rects[i];
+	}
+
+	qsort(sortedRects, numRects, sizeof(Rect*), Cram_Internal_Guillotine_CompareRects);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		if (!Cram_Internal_GuillotineFreeList_Place(&context->freeList, context->allowRotation, sortedRects[i]))
+		{
+			result = -1;
+			continue;
+		}
+
+		context->placementCount += 1;
+		context->freeRectangleTotal += context->freeList.count;
+		context->freeRectanglePeak = max(context->freeRectanglePeak, context->freeList.count);
+	}
+
+	free(sortedRects);
+
+	return result;
+}
+
+static void Cram_Internal_Guillotine_AddStats(Cram_Internal_Packer *packer, Cram_PackStats *stats)
+{
+	GuillotinePackContext *context = (GuillotinePackContext*) packer->driverData;
+
+	stats->placementCount += context->placementCount;
+	stats->freeRectangleTotal += context->freeRectangleTotal;
+	stats->freeRectanglePeak = max(stats->freeRectanglePeak, context->freeRectanglePeak);
+}
+
+static void Cram_Internal_Guillotine_Destroy(Cram_Internal_Packer *packer)
+{
+	GuillotinePackContext *context = (GuillotinePackContext*) packer->driverData;
+
+	free(context->freeList.rectangles);
+	free(context);
+	free(packer);
+}
+
+static Cram_Internal_Packer* Cram_Internal_Guillotine_Create(int32_t width, int32_t height, uint8_t allowRotation)
+{
+	Cram_Internal_Packer *packer = malloc(sizeof(Cram_Internal_Packer));
+	GuillotinePackContext *context = malloc(sizeof(GuillotinePackContext));
+
+	packer->Reset = Cram_Internal_Guillotine_Reset;
+	packer->Grow = Cram_Internal_Guillotine_Grow;
+	packer->PackRects = Cram_Internal_Guillotine_PackRects;
+	packer->AddStats = Cram_Internal_Guillotine_AddStats;
+	packer->Destroy = Cram_Internal_Guillotine_Destroy;
+
+	packer->driverData = context;
+	packer->heuristic = CRAM_HEURISTIC_BEST_AREA_FIT;
+
+	context->allowRotation = allowRotation;
+
+	context->freeList.rectangles = NULL;
+	context->freeList.capacity = 0;
+	context->freeList.merge = 1;
+
+	context->placementCount = 0;
+	context->freeRectangleTotal = 0;
+	context->freeRectanglePeak = 0;
+
+	Cram_Internal_Guillotine_Reset(packer, width, height);
+
+	return packer;
+}
+
+/* Shelf engine */
+
+static void Cram_Internal_Shelf_Reset(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	ShelfPackContext *context = (ShelfPackContext*) packer->driverData;
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+
+	context->shelfX = 0;
+	context->shelfY = 0;
+	context->shelfHeight = 0;
+}
+
+/* The open shelf just gets longer, closed shelves stay as they are. */
+static void Cram_Internal_Shelf_Grow(Cram_Internal_Packer *packer, int32_t width, int32_t height)
+{
+	ShelfPackContext *context = (ShelfPackContext*) packer->driverData;
+
+	packer->width = width;
+	packer->height = height;
+
+	context->width = width;
+	context->height = height;
+}
+
+static int8_t Cram_Internal_Shelf_PackRects(Cram_Internal_Packer *packer, Rect *rects, int32_t numRects)
+{
+	ShelfPackContext *context = (ShelfPackContext*) packer->driverData;
+	Rect **sortedRects = malloc(sizeof(Rect*) * numRects);
+	Rect *rect;
+	int32_t swap, i;
+	int8_t result = 0;
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rect = &rects[i];
+
+		/* lying flat keeps the shelves low */
+		if (context->allowRotation && rect->h > rect->w && rect->h <= context->width)
+		{
+			swap = rect->w;
+			rect->w = rect->h;
+			rect->h = swap;
+		}
+
+		sortedRects[i] = rect;
+	}
+
+	/* tallest first, so the first rect on a shelf decides its height */
+	qsort(sortedRects, numRects, sizeof(Rect*), Cram_Internal_Skyline_CompareRects);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		rect = sortedRects[i];
+
+		if (rect->w > context->width)
+		{
+			result = -1;
+			continue;
+		}
+
+		if (context->shelfX + rect->w > context->width)
+		{
+			context->shelfY += context->shelfHeight;
+			context->shelfX = 0;
+			context->shelfHeight = 0;
+		}
+
+		if (context->shelfY + rect->h > context->height)
+		{
+			result = -1;
+			continue;
+		}
+
+		rect->x = context->shelfX;
+		rect->y = context->shelfY;
+
+		context->shelfX += rect->w;
+		context->shelfHeight = max(context->shelfHeight, rect->h);
+
+		context->placementCount += 1;
+	}
+
+	free(sortedRects);
+
+	return result;
+}
+
+static void Cram_Internal_Shelf_AddStats(Cram_Internal_Packer *packer, Cram_PackStats *stats)
+{
+	ShelfPackContext *context = (ShelfPackContext*) packer->driverData;
+
+	/* the open shelf is the only free space tracked */
+	stats->placementCount += context->placementCount;
+	stats->freeRectangleTotal += context->placementCount;
+	stats->freeRectanglePeak = max(stats->freeRectanglePeak, 1);
+}
+
+static void Cram_Internal_Shelf_Destroy(Cram_Internal_Packer *packer)
+{
+	free(packer->driverData);
+	free(packer);
+}
+
+static Cram_Internal_Packer* Cram_Internal_Shelf_Create(int32_t width, int32_t height, uint8_t allowRotation)
+{
+	Cram_Internal_Packer *packer = malloc(sizeof(Cram_Internal_Packer));
+	ShelfPackContext *context = malloc(sizeof(ShelfPackContext));
+
+	packer->Reset = Cram_Internal_Shelf_Reset;
+	packer->Grow = Cram_Internal_Shelf_Grow;
+	packer->PackRects = Cram_Internal_Shelf_PackRects;
+	packer->AddStats = Cram_Internal_Shelf_AddStats;
+	packer->Destroy = Cram_Internal_Shelf_Destroy;
+
+	packer->driverData = context;
+	packer->heuristic = CRAM_HEURISTIC_BOTTOM_LEFT;
+
+	context->allowRotation = allowRotation;
+	context->placementCount = 0;
+
+	Cram_Internal_Shelf_Reset(packer, width, height);
+
+	return packer;
+}
+
+static Cram_Internal_Packer* Cram_Internal_CreatePacker(
+	Cram_PackerType packerType,
+	int32_t width,
+	int32_t height,
+	Cram_Heuristic heuristic,
+	Cram_PackOrder packOrder,
+	uint8_t allowRotation
+) {
+	switch (packerType)
+	{
+		case CRAM_PACKER_SKYLINE:
+			return Cram_Internal_Skyline_Create(width, height, allowRotation, 0);
+
+		case CRAM_PACKER_SKYLINE_WASTE_MAP:
+			return Cram_Internal_Skyline_Create(width, height, allowRotation, 1);
+
+		case CRAM_PACKER_GUILLOTINE:
+			return Cram_Internal_Guillotine_Create(width, height, allowRotation);
+
+		case CRAM_PACKER_SHELF:
+			return Cram_Internal_Shelf_Create(width, height, allowRotation);
+
+		default:
+			return Cram_Internal_MaxRects_Create(width, height, heuristic, packOrder, allowRotation);
+	}
+}
+
+/* In power of two mode candidate atlas sizes start at 32x32 and double width and height in turn.
+ * Otherwise candidates are squares growing from the smallest side that could fit,
+ * up to maxDimension, and the atlas is cropped once packing succeeds.
+ */
+static inline void Cram_Internal_GetCandidateSize(Cram_Internal_PackJob *packJob, int32_t candidate, int32_t *pWidth, int32_t *pHeight)
+{
+	int32_t side;
+
+	if (packJob->sizeMode == CRAM_SIZE_POWER_OF_TWO)
+	{
+		*pWidth = INITIAL_DIMENSION << ((candidate + 1) / 2);
+		*pHeight = INITIAL_DIMENSION << (candidate / 2);
+	}
+	else
+	{
+		side = min(packJob->baseSide + packJob->sideStep * candidate, packJob->maxDimension);
+
+		if (packJob->sizeMode == CRAM_SIZE_MULTIPLE_OF_FOUR)
+		{
+			side = (side + 3) & ~3;
+
+			if (side > packJob->maxDimension)
+			{
+				side -= 4;
+			}
+		}
+
+		*pWidth = side;
+		*pHeight = side;
+	}
+}
+
+/* The first power of two candidate is always tried, to match the old growth loop. */
+static inline uint8_t Cram_Internal_IsCandidateValid(Cram_Internal_PackJob *packJob, int32_t candidate)
+{
+	int32_t width, height;
+
+	if (packJob->sizeMode == CRAM_SIZE_POWER_OF_TWO)
+	{
+		if (candidate == 0)
+		{
+			return 1;
+		}
+
+		Cram_Internal_GetCandidateSize(packJob, candidate, &width, &height);
+		return width <= packJob->maxDimension && height <= packJob->maxDimension;
+	}
+
+	/* the last candidate is clamped to maxDimension */
+	if (candidate == 0)
+	{
+		return packJob->baseSide <= packJob->maxDimension;
+	}
+
+	return packJob->baseSide + packJob->sideStep * (candidate - 1) < packJob->maxDimension;
+}
+
+/* Any candidate smaller in area than the rects, or narrower or shorter than one of them, can't fit. */
+static int32_t Cram_Internal_GetFirstCandidate(Cram_Internal_PackJob *packJob)
+{
+	int64_t totalArea = 0;
+	int32_t maxWidth = 0, maxHeight = 0;
+	int32_t width, height;
+	int32_t candidate = 0;
+	int32_t i;
+	Rect *rect;
+
+	for (i = 0; i < packJob->numRects; i += 1)
+	{
+		rect = &packJob->sourceRects[i];
+		totalArea += (int64_t) rect->w * rect->h;
+		maxWidth = max(maxWidth, rect->w);
+		maxHeight = max(maxHeight, rect->h);
+	}
+
+	if (packJob->sizeMode != CRAM_SIZE_POWER_OF_TWO)
+	{
+		packJob->baseSide = max(maxWidth, maxHeight);
+		while ((int64_t) packJob->baseSide * packJob->baseSide < totalArea)
+		{
+			packJob->baseSide += 1;
+		}
+		packJob->baseSide = max(packJob->baseSide, 1);
+
+		/* small steps keep the atlas tight, concurrent probing hides most of the extra attempts */
+		packJob->sideStep = max(packJob->baseSide / 32, 1);
+
+		return 0;
+	}
+
+	while (Cram_Internal_IsCandidateValid(packJob, candidate))
+	{
+		Cram_Internal_GetCandidateSize(packJob, candidate, &width, &height);
+
+		if ((int64_t) width * height >= totalArea)
+		{
+			if (packJob->allowRotation)
+			{
+				/* this is weaker than it could be, but only needs to rule out sizes that can't fit */
+				if (max(width, height) >= max(maxWidth, maxHeight))
+				{
+					break;
+				}
+			}
+			else if (width >= maxWidth && height >= maxHeight)
+			{
+				break;
+			}
+		}
+
+		candidate += 1;
+	}
+
+	return candidate;
+}
+
+/* The biggest atlas the size search could end up with. */
+static void Cram_Internal_GetLargestSize(Cram_Internal_PackJob *packJob, int32_t *pWidth, int32_t *pHeight)
+{
+	int32_t candidate = 0;
+
+	if (packJob->sizeMode == CRAM_SIZE_POWER_OF_TWO)
+	{
+		while (Cram_Internal_IsCandidateValid(packJob, candidate + 1))
+		{
+			candidate += 1;
+		}
+
+		Cram_Internal_GetCandidateSize(packJob, candidate, pWidth, pHeight);
+	}
+	else
+	{
+		*pWidth = packJob->sizeMode == CRAM_SIZE_MULTIPLE_OF_FOUR ?
+			packJob->maxDimension & ~3 :
+			packJob->maxDimension;
+		*pHeight = *pWidth;
+	}
+}
+
+/* Power of two atlases keep their full size, the other modes are cropped to the packed images. */
+static void Cram_Internal_GetOutputSize(
+	Cram_SizeMode sizeMode,
+	Rect *rects,
+	int32_t numRects,
+	int32_t padding,
+	int32_t binWidth,
+	int32_t binHeight,
+	int32_t *pWidth,
+	int32_t *pHeight
+) {
+	int32_t width = 1, height = 1;
+	int32_t i;
+
+	if (sizeMode == CRAM_SIZE_POWER_OF_TWO)
+	{
+		*pWidth = binWidth;
+		*pHeight = binHeight;
+		return;
+	}
+
+	/* padding trails each rect, so the last row and column of it can go */
+	for (i = 0; i < numRects; i += 1)
+	{
+		width = max(width, rects[i].x + rects[i].w - padding);
+		height = max(height, rects[i].y + rects[i].h - padding);
+	}
+
+	if (sizeMode == CRAM_SIZE_MULTIPLE_OF_FOUR)
+	{
+		width = (width + 3) & ~3;
+		height = (height + 3) & ~3;
+	}
+	else if (sizeMode == CRAM_SIZE_SQUARE)
+	{
+		width = max(width, height);
+		height = width;
+	}
+
+	*pWidth = width;
+	*pHeight = height;
+}
+
+static void Cram_Internal_PackJobFunc(void *userdata, int32_t index)
+{
+	Cram_Internal_PackJob *packJob = (Cram_Internal_PackJob*) userdata;
+	int32_t width, height;
+
+	if (packJob->candidates[index] < 0)
+	{
+		return;
+	}
+
+	Cram_Internal_GetCandidateSize(packJob, packJob->candidates[index], &width, &height);
+	packJob->packers[index]->Reset(packJob->packers[index], width, height);
+
+	memcpy(packJob->rects[index], packJob->sourceRects, sizeof(Rect) * packJob->numRects);
+
+	packJob->results[index] = packJob->packers[index]->PackRects(
+		packJob->packers[index],
+		packJob->rects[index],
+		packJob->numRects
+	);
+}
+
+/* Packs into the packer's first candidate and grows it up the candidate ladder whenever rects are left over,
+ * packing only the leftovers into each bigger size.
+ */
+static void Cram_Internal_GrowJobFunc(void *userdata, int32_t index)
+{
+	Cram_Internal_PackJob *packJob = (Cram_Internal_PackJob*) userdata;
+	Cram_Internal_Packer *packer = packJob->packers[index];
+	Rect *rects = packJob->rects[index];
+	Rect *leftoverRects;
+	int32_t *leftoverIndices;
+	int32_t leftoverCount;
+	int32_t width, height;
+	int32_t i;
+
+	if (packJob->candidates[index] < 0)
+	{
+		return;
+	}
+
+	leftoverRects = malloc(sizeof(Rect) * packJob->numRects);
+	leftoverIndices = malloc(sizeof(int32_t) * packJob->numRects);
+
+	Cram_Internal_GetCandidateSize(packJob, packJob->candidates[index], &width, &height);
+	packer->Reset(packer, width, height);
+
+	/* packers leave the rects they can't place alone */
+	for (i = 0; i < packJob->numRects; i += 1)
+	{
+		rects[i] = packJob->sourceRects[i];
+		rects[i].x = -1;
+	}
+
+	while (1)
+	{
+		leftoverCount = 0;
+
+		for (i = 0; i < packJob->numRects; i += 1)
+		{
+			if (rects[i].x < 0)
+			{
+				leftoverRects[leftoverCount] = rects[i];
+				leftoverIndices[leftoverCount] = i;
+				leftoverCount += 1;
+			}
+		}
+
+		packJob->results[index] = packer->PackRects(packer, leftoverRects, leftoverCount);
+
+		for (i = 0; i < leftoverCount; i += 1)
+		{
+			rects[leftoverIndices[i]] = leftoverRects[i];
+		}
+
+		if (packJob->results[index] == 0 || !Cram_Internal_IsCandidateValid(packJob, packJob->candidates[index] + 1))
+		{
+			break;
+		}
+
+		packJob->candidates[index] += 1;
+		Cram_Internal_GetCandidateSize(packJob, packJob->candidates[index], &width, &height);
+		packer->Grow(packer, width, height);
+	}
+
+	free(leftoverRects);
+	free(leftoverIndices);
+}
+
+static void Cram_Internal_InitPackJob(Cram_Internal_Context *context, Cram_Internal_PackJob *packJob, Rect *rects, int32_t numRects)
+{
+	packJob->sourceRects = rects;
+	packJob->numRects = numRects;
+	packJob->allowRotation = context->rotate;
+	packJob->sizeMode = context->sizeMode;
+	packJob->maxDimension = context->maxDimension;
+	packJob->baseSide = 0;
+	packJob->sideStep = 0;
+}
+
+static void Cram_Internal_AddPackAttempt(Cram_Internal_PagePack *pagePack, Cram_Internal_Packer *packer, uint8_t success)
+{
+	Cram_PackAttempt *attempt;
+
+	if (pagePack->attemptCount == pagePack->attemptCapacity)
+	{
+		pagePack->attemptCapacity = max(pagePack->attemptCapacity * 2, INITIAL_DATA_CAPACITY);
+		pagePack->attempts = realloc(pagePack->attempts, sizeof(Cram_PackAttempt) * pagePack->attemptCapacity);
+	}
+
+	attempt = &pagePack->attempts[pagePack->attemptCount];
+	attempt->width = packer->width;
+	attempt->height = packer->height;
+	attempt->heuristic = packer->heuristic;
+	attempt->page = pagePack->page;
+	attempt->success = success;
+
+	pagePack->attemptCount += 1;
+}
+
+/* splitmix64, small and good enough to shuffle sort keys */
+static inline uint64_t Cram_Internal_NextRandom(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+/* One slot per thread, each round packs one restart per slot. */
+typedef struct Cram_Internal_OptimizeJob
+{
+	Cram_Internal_PackJob *packJob;
+	Cram_Internal_Packer **packers;
+	Rect **rects;
+	OrderedRect **orderedRects;
+	int32_t *candidates;
+	int8_t *results;
+	int32_t restartCount; /* in this round */
+	uint64_t firstRestart;
+	uint32_t seed;
+	int32_t bestCandidate;
+	int32_t firstCandidate;
+} Cram_Internal_OptimizeJob;
+
+/* Everything a restart does is drawn from its own seed, so it doesn't matter which thread runs it. */
+static void Cram_Internal_OptimizeJobFunc(void *userdata, int32_t index)
+{
+	/* contact point is left out, it is too slow to restart many times */
+	static const Cram_Heuristic heuristics[] =
+	{
+		CRAM_HEURISTIC_BEST_AREA_FIT,
+		CRAM_HEURISTIC_BEST_SHORT_SIDE_FIT,
+		CRAM_HEURISTIC_BEST_LONG_SIDE_FIT,
+		CRAM_HEURISTIC_BOTTOM_LEFT
+	};
+	Cram_Internal_OptimizeJob *optimizeJob = (Cram_Internal_OptimizeJob*) userdata;
+	Cram_Internal_PackJob *packJob = optimizeJob->packJob;
+	Cram_Internal_Packer *packer = optimizeJob->packers[index];
+	RectPackContext *rectPacker = (RectPackContext*) packer->driverData;
+	Rect *rects = optimizeJob->rects[index];
+	OrderedRect *orderedRects = optimizeJob->orderedRects[index];
+	uint64_t restart = optimizeJob->firstRestart + index;
+	uint64_t state = ((uint64_t) optimizeJob->seed << 32) ^ restart;
+	Cram_PackOrder packOrder;
+	int64_t key;
+	int32_t noise;
+	int32_t width, height;
+	int32_t i;
+
+	if (index >= optimizeJob->restartCount)
+	{
+		optimizeJob->candidates[index] = -1;
+		return;
+	}
+
+	Cram_Internal_NextRandom(&state);
+
+	/* Power of two sizes don't crop, so only the next size down can be an improvement.
+	 * Otherwise every other restart tries for a tighter crop at the size that already fits.
+	 */
+	if (optimizeJob->bestCandidate > optimizeJob->firstCandidate &&
+		(packJob->sizeMode == CRAM_SIZE_POWER_OF_TWO || (restart & 1) == 0))
+	{
+		optimizeJob->candidates[index] = optimizeJob->bestCandidate - 1;
+	}
+	else
+	{
+		optimizeJob->candidates[index] = optimizeJob->bestCandidate;
+	}
+
+	/* switching between these is safe, only contact point keeps extra state across a reset */
+	packer->heuristic = heuristics[Cram_Internal_NextRandom(&state) % 4];
+	rectPacker->heuristic = packer->heuristic;
+
+	packOrder = (Cram_PackOrder) (CRAM_ORDER_MAX_SIDE + Cram_Internal_NextRandom(&state) % 3);
+	noise = (int32_t) (Cram_Internal_NextRandom(&state) % 257);
+
+	memcpy(rects, packJob->sourceRects, sizeof(Rect) * packJob->numRects);
+
+	/* scale every key by up to 1 + noise / 1024 so neighbours in the order can trade places */
+	for (i = 0; i < packJob->numRects; i += 1)
+	{
+		key = Cram_Internal_GetOrderKey(packOrder, &rects[i]);
+		key = key * (1024 + (int32_t) (Cram_Internal_NextRandom(&state) % (noise + 1))) / 1024;
+
+		orderedRects[i].key = (int32_t) min(key, INT32_MAX);
+		orderedRects[i].index = i;
+		orderedRects[i].rect = &rects[i];
+	}
+
+	Cram_Internal_GetCandidateSize(packJob, optimizeJob->candidates[index], &width, &height);
+	packer->Reset(packer, width, height);
+
+	optimizeJob->results[index] = Cram_Internal_PackMaxRectsInOrder(rectPacker, orderedRects, packJob->numRects);
+}
+
+/* Randomized restarts on top of a layout that already fits, adopting any that yields a smaller atlas.
+ * Rounds run one restart per thread and the budget is only checked between rounds,
+ * so with a restart limit the result depends only on the seed and the thread count.
+ */
+static void Cram_Internal_OptimizeLayout(
+	Cram_Internal_Context *context,
+	Cram_Internal_PagePack *pagePack,
+	Cram_Internal_PackJob *packJob,
+	int32_t bestCandidate,
+	int32_t firstCandidate,
+	int32_t threadCount
+) {
+	Cram_Internal_OptimizeJob optimizeJob;
+	Rect *sourceRects;
+	uint64_t startTime = Cram_Internal_GetMilliseconds();
+	uint64_t restart = 0;
+	int32_t width, height;
+	int32_t i;
+
+	/* the page's rects get overwritten by better layouts, so restarts work from a copy */
+	sourceRects = malloc(sizeof(Rect) * pagePack->numRects);
+	memcpy(sourceRects, pagePack->rects, sizeof(Rect) * pagePack->numRects);
+	packJob->sourceRects = sourceRects;
+
+	optimizeJob.packJob = packJob;
+	optimizeJob.packers = malloc(sizeof(Cram_Internal_Packer*) * threadCount);
+	optimizeJob.rects = malloc(sizeof(Rect*) * threadCount);
+	optimizeJob.orderedRects = malloc(sizeof(OrderedRect*) * threadCount);
+	optimizeJob.candidates = malloc(sizeof(int32_t) * threadCount);
+	optimizeJob.results = malloc(sizeof(int8_t) * threadCount);
+	optimizeJob.seed = context->optimizeSeed;
+	optimizeJob.bestCandidate = bestCandidate;
+	optimizeJob.firstCandidate = firstCandidate;
+
+	for (i = 0; i < threadCount; i += 1)
+	{
+		optimizeJob.packers[i] = Cram_Internal_MaxRects_Create(
+			INITIAL_DIMENSION,
+			INITIAL_DIMENSION,
+			CRAM_HEURISTIC_BEST_AREA_FIT,
+			CRAM_ORDER_MAX_SIDE,
+			packJob->allowRotation
+		);
+		optimizeJob.rects[i] = malloc(sizeof(Rect) * pagePack->numRects);
+		optimizeJob.orderedRects[i] = malloc(sizeof(OrderedRect) * pagePack->numRects);
+	}
+
+	while (context->optimizeRestarts == 0 || restart < context->optimizeRestarts)
+	{
+		if (context->optimizeMilliseconds > 0 && Cram_Internal_GetMilliseconds() - startTime >= context->optimizeMilliseconds)
+		{
+			break;
+		}
+
+		/* a power of two layout at the smallest size can't be beaten */
+		if (packJob->sizeMode == CRAM_SIZE_POWER_OF_TWO && optimizeJob.bestCandidate == firstCandidate)
+		{
+			break;
+		}
+
+		optimizeJob.firstRestart = restart;
+		optimizeJob.restartCount = threadCount;
+
+		if (context->optimizeRestarts > 0)
+		{
+			optimizeJob.restartCount = (int32_t) min((uint64_t) threadCount, context->optimizeRestarts - restart);
+		}
+
+		Cram_Internal_ParallelFor(
+			threadCount,
+			threadCount,
+			Cram_Internal_OptimizeJobFunc,
+			&optimizeJob
+		);
+
+		/* restarts are merged in order, earlier ones win ties */
+		for (i = 0; i < optimizeJob.restartCount; i += 1)
+		{
+			Cram_Internal_AddPackAttempt(pagePack, optimizeJob.packers[i], optimizeJob.results[i] == 0);
+
+			if (optimizeJob.results[i] != 0)
+			{
+				continue;
+			}
+
+			Cram_Internal_GetOutputSize(
+				packJob->sizeMode,
+				optimizeJob.rects[i],
+				pagePack->numRects,
+				context->padding,
+				optimizeJob.packers[i]->width,
+				optimizeJob.packers[i]->height,
+				&width,
+				&height
+			);
+
+			if ((int64_t) width * height < (int64_t) pagePack->width * pagePack->height)
+			{
+				memcpy(pagePack->rects, optimizeJob.rects[i], sizeof(Rect) * pagePack->numRects);
+				pagePack->width = width;
+				pagePack->height = height;
+				optimizeJob.bestCandidate = optimizeJob.candidates[i];
+			}
+		}
+
+		restart += optimizeJob.restartCount;
+	}
+
+	for (i = 0; i < threadCount; i += 1)
+	{
+		optimizeJob.packers[i]->AddStats(optimizeJob.packers[i], &pagePack->stats);
+		optimizeJob.packers[i]->Destroy(optimizeJob.packers[i]);
+		free(optimizeJob.rects[i]);
+		free(optimizeJob.orderedRects[i]);
+	}
+
+	free(optimizeJob.packers);
+	free(optimizeJob.rects);
+	free(optimizeJob.orderedRects);
+	free(optimizeJob.candidates);
+	free(optimizeJob.results);
+
+	packJob->sourceRects = pagePack->rects;
+	free(sourceRects);
+}
+
+/* Finds the smallest atlas the page's rects fit in and leaves them packed into it. */
+static void Cram_Internal_SearchPackSize(Cram_Internal_Context *context, Cram_Internal_PagePack *pagePack, int32_t threadCount)
+{
+	Cram_Internal_PackJob packJob;
+	Cram_Heuristic heuristics[CRAM_HEURISTIC_AUTO];
+	int32_t nextCandidates[CRAM_HEURISTIC_AUTO];
+	int32_t bestPackers[CRAM_HEURISTIC_AUTO]; /* -1 until the heuristic fits, -2 once it runs out of sizes */
+	int32_t heuristicCount, sizeCount, packerCount, bestPacker, packer;
+	int32_t firstCandidate;
+	int32_t width, height;
+	uint8_t searching;
+	int32_t i, j;
+
+	/* In auto mode every heuristic packs its own copy of the rects concurrently. */
+	if (context->packerType == CRAM_PACKER_MAXRECTS && context->heuristic == CRAM_HEURISTIC_AUTO)
+	{
+		heuristicCount = CRAM_HEURISTIC_AUTO;
+		for (i = 0; i < heuristicCount; i += 1)
+		{
+			heuristics[i] = (Cram_Heuristic) i;
+		}
+	}
+	else
+	{
+		heuristicCount = 1;
+		heuristics[0] = context->heuristic;
+	}
+
+	/* Spare threads try the next few sizes up at the same time.
+	 * The smallest size that fits wins, so the result is the same as trying them one by one.
+	 */
+	sizeCount = context->growInPlace ? 1 : max(1, threadCount / heuristicCount);
+	packerCount = heuristicCount * sizeCount;
+
+	Cram_Internal_InitPackJob(context, &packJob, pagePack->rects, pagePack->numRects);
+	packJob.packers = malloc(sizeof(Cram_Internal_Packer*) * packerCount);
+	packJob.rects = malloc(sizeof(Rect*) * packerCount);
+	packJob.candidates = malloc(sizeof(int32_t) * packerCount);
+	packJob.results = malloc(sizeof(int8_t) * packerCount);
+
+	for (i = 0; i < packerCount; i += 1)
+	{
+		packJob.packers[i] = Cram_Internal_CreatePacker(
+			context->packerType,
+			INITIAL_DIMENSION,
+			INITIAL_DIMENSION,
+			heuristics[i / sizeCount],
+			context->packOrder,
+			packJob.allowRotation
+		);
+		packJob.rects[i] = malloc(sizeof(Rect) * pagePack->numRects);
+	}
+
+	firstCandidate = Cram_Internal_GetFirstCandidate(&packJob);
+
+	for (i = 0; i < heuristicCount; i += 1)
+	{
+		nextCandidates[i] = firstCandidate;
+		bestPackers[i] = Cram_Internal_IsCandidateValid(&packJob, nextCandidates[i]) ? -1 : -2;
+	}
+
+	/* Growing packs every heuristic in a single pass, no size is tried twice. */
+	searching = !context->growInPlace;
+
+	if (context->growInPlace)
+	{
+		for (i = 0; i < heuristicCount; i += 1)
+		{
+			packJob.candidates[i] = bestPackers[i] == -1 ? nextCandidates[i] : -1;
+		}
+
+		Cram_Internal_ParallelFor(
+			threadCount,
+			heuristicCount,
+			Cram_Internal_GrowJobFunc,
+			&packJob
+		);
+
+		for (i = 0; i < heuristicCount; i += 1)
+		{
+			if (packJob.candidates[i] >= 0)
+			{
+				Cram_Internal_AddPackAttempt(pagePack, packJob.packers[i], packJob.results[i] == 0);
+				bestPackers[i] = packJob.results[i] == 0 ? i : -2;
+			}
+		}
+	}
+
+	while (searching)
+	{
+		for (i = 0; i < heuristicCount; i += 1)
+		{
+			for (j = 0; j < sizeCount; j += 1)
+			{
+				packJob.candidates[i * sizeCount + j] =
+					bestPackers[i] == -1 && Cram_Internal_IsCandidateValid(&packJob, nextCandidates[i] + j) ?
+						nextCandidates[i] + j :
+						-1;
+			}
+		}
+
+		Cram_Internal_ParallelFor(
+			threadCount,
+			packerCount,
+			Cram_Internal_PackJobFunc,
+			&packJob
+		);
+
+		searching = 0;
+
+		for (i = 0; i < heuristicCount; i += 1)
+		{
+			for (j = 0; j < sizeCount; j += 1)
+			{
+				packer = i * sizeCount + j;
+
+				if (packJob.candidates[packer] >= 0)
+				{
+					Cram_Internal_AddPackAttempt(pagePack, packJob.packers[packer], packJob.results[packer] == 0);
+
+					if (packJob.results[packer] == 0 && bestPackers[i] == -1)
+					{
+						bestPackers[i] = packer;
+					}
+				}
+			}
+
+			if (bestPackers[i] == -1)
+			{
+				nextCandidates[i] += sizeCount;
+
+				if (Cram_Internal_IsCandidateValid(&packJob, nextCandidates[i]))
+				{
+					searching = 1;
+				}
+				else
+				{
+					bestPackers[i] = -2;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < packerCount; i += 1)
+	{
+		packJob.packers[i]->AddStats(packJob.packers[i], &pagePack->stats);
+	}
+
+	/* keep the smallest atlas, earlier heuristics win ties */
+	bestPacker = -1;
+
+	for (i = 0; i < heuristicCount; i += 1)
+	{
+		packer = bestPackers[i];
+
+		if (packer >= 0)
+		{
+			Cram_Internal_GetOutputSize(
+				packJob.sizeMode,
+				packJob.rects[packer],
+				packJob.numRects,
+				context->padding,
+				packJob.packers[packer]->width,
+				packJob.packers[packer]->height,
+				&width,
+				&height
+			);
+
+			if (bestPacker < 0 || (int64_t) width * height < (int64_t) pagePack->width * pagePack->height)
+			{
+				bestPacker = packer;
+				pagePack->width = width;
+				pagePack->height = height;
+			}
+		}
+	}
+
+	if (bestPacker >= 0)
+	{
+		memcpy(pagePack->rects, packJob.rects[bestPacker], sizeof(Rect) * pagePack->numRects);
+
+		if (context->packerType == CRAM_PACKER_MAXRECTS &&
+			(context->optimizeMilliseconds > 0 || context->optimizeRestarts > 0))
+		{
+			Cram_Internal_OptimizeLayout(
+				context,
+				pagePack,
+				&packJob,
+				packJob.candidates[bestPacker],
+				firstCandidate,
+				threadCount
+			);
+		}
+	}
+
+	pagePack->result = bestPacker >= 0 ? 0 : -1;
+
+	for (i = 0; i < packerCount; i += 1)
+	{
+		packJob.packers[i]->Destroy(packJob.packers[i]);
+		free(packJob.rects[i]);
+	}
+
+	free(packJob.packers);
+	free(packJob.rects);
+	free(packJob.candidates);
+	free(packJob.results);
+}
+
+static void Cram_Internal_PackPageJob(void *userdata, int32_t index)
+{
+	Cram_Internal_PageJob *pageJob = (Cram_Internal_PageJob*) userdata;
+
+	/* pages already run side by side, so each one searches on a single thread */
+	Cram_Internal_SearchPackSize(pageJob->context, &pageJob->pagePacks[index], 1);
+}
+
+/* Fills pages of the largest allowed size one at a time until every rect has a page.
+ * Each rect's spot on its filled page goes into assignedRects.
+ * Returns the page count, or -1 if some rect doesn't fit on a page at all.
+ */
+static int32_t Cram_Internal_AssignPages(
+	Cram_Internal_Context *context,
+	Rect *rects,
+	int32_t numRects,
+	int32_t *rectPages,
+	Rect *assignedRects,
+	int32_t *pPageWidth,
+	int32_t *pPageHeight
+) {
+	Cram_Internal_PackJob packJob;
+	Cram_Internal_Packer *packer;
+	Rect *pageRects = malloc(sizeof(Rect) * numRects);
+	int32_t *remaining = malloc(sizeof(int32_t) * numRects);
+	int32_t remainingCount = numRects;
+	int32_t pageCount = 0;
+	int32_t width, height, placedCount, i;
+
+	Cram_Internal_InitPackJob(context, &packJob, rects, numRects);
+	Cram_Internal_GetLargestSize(&packJob, &width, &height);
+
+	packer = Cram_Internal_CreatePacker(
+		context->packerType,
+		width,
+		height,
+		context->heuristic == CRAM_HEURISTIC_AUTO ? CRAM_HEURISTIC_BEST_AREA_FIT : context->heuristic,
+		context->packOrder,
+		context->rotate
+	);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		remaining[i] = i;
+	}
+
+	while (remainingCount > 0)
+	{
+		packer->Reset(packer, width, height);
+
+		for (i = 0; i < remainingCount; i += 1)
+		{
+			pageRects[i] = rects[remaining[i]];
+			pageRects[i].x = -1; /* stays negative if the rect doesn't make it onto this page */
+		}
+
+		packer->PackRects(packer, pageRects, remainingCount);
+
+		placedCount = 0;
+		for (i = 0; i < remainingCount; i += 1)
+		{
+			if (pageRects[i].x >= 0)
+			{
+				rectPages[remaining[i]] = pageCount;
+				assignedRects[remaining[i]] = pageRects[i];
+				placedCount += 1;
+			}
+			else
+			{
+				remaining[i - placedCount] = remaining[i];
+			}
+		}
+
+		if (placedCount == 0)
+		{
+			pageCount = -1;
+			break;
+		}
+
+		remainingCount -= placedCount;
+		pageCount += 1;
+	}
+
+	packer->AddStats(packer, &context->packStats);
+	packer->Destroy(packer);
+
+	free(pageRects);
+	free(remaining);
+
+	*pPageWidth = width;
+	*pPageHeight = height;
+
+	return pageCount;
+}
+
+static void Cram_Internal_InitPagePacks(
+	Cram_Internal_PagePack *pagePacks,
+	int32_t pageCount,
+	Rect *rects,
+	int32_t numRects,
+	int32_t *rectPages
+) {
+	Cram_Internal_PagePack *pagePack;
+	int32_t i;
+
+	memset(pagePacks, 0, sizeof(Cram_Internal_PagePack) * pageCount);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		pagePacks[rectPages[i]].numRects += 1;
+	}
+
+	for (i = 0; i < pageCount; i += 1)
+	{
+		pagePacks[i].page = i;
+		pagePacks[i].rects = malloc(sizeof(Rect) * pagePacks[i].numRects);
+		pagePacks[i].rectIndices = malloc(sizeof(int32_t) * pagePacks[i].numRects);
+		pagePacks[i].numRects = 0;
+	}
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		pagePack = &pagePacks[rectPages[i]];
+		pagePack->rects[pagePack->numRects] = rects[i];
+		pagePack->rectIndices[pagePack->numRects] = i;
+		pagePack->numRects += 1;
+	}
+}
+
+/* Hands the page's attempts and stats over to the context and frees it. */
+static void Cram_Internal_ReleasePagePack(Cram_Internal_Context *context, Cram_Internal_PagePack *pagePack)
+{
+	int32_t i;
+
+	for (i = 0; i < pagePack->attemptCount; i += 1)
+	{
+		if (context->packAttemptCount == context->packAttemptCapacity)
+		{
+			context->packAttemptCapacity = max(context->packAttemptCapacity * 2, INITIAL_DATA_CAPACITY);
+			context->packAttempts = realloc(context->packAttempts, sizeof(Cram_PackAttempt) * context->packAttemptCapacity);
+		}
+
+		context->packAttempts[context->packAttemptCount] = pagePack->attempts[i];
+		context->packAttemptCount += 1;
+	}
+
+	context->packStats.placementCount += pagePack->stats.placementCount;
+	context->packStats.freeRectangleTotal += pagePack->stats.freeRectangleTotal;
+	context->packStats.freeRectanglePeak = max(context->packStats.freeRectanglePeak, pagePack->stats.freeRectanglePeak);
+	context->packStats.containmentTestCount += pagePack->stats.containmentTestCount;
+
+	free(pagePack->attempts);
+	free(pagePack->rects);
+	free(pagePack->rectIndices);
+}
+
+/* API functions */
+
+uint32_t Cram_LinkedVersion(void)
+{
+	return CRAM_COMPILED_VERSION;
+}
+
+Cram_Context* Cram_Init(Cram_ContextCreateInfo *createInfo)
+{
+	Cram_Internal_Context *context = malloc(sizeof(Cram_Internal_Context));
+
+	context->name = strdup(createInfo->name);
+
+	context->padding = createInfo->padding;
+	context->trim = createInfo->trim;
+	context->packerType = createInfo->packerType;
+	context->heuristic = createInfo->heuristic;
+	context->packOrder = createInfo->packOrder;
+	context->sizeMode = createInfo->sizeMode;
+	context->rotate = createInfo->rotate;
+	context->multiPage = createInfo->multiPage;
+	context->growInPlace = createInfo->growInPlace;
+	context->optimizeMilliseconds = createInfo->optimizeMilliseconds;
+	context->optimizeRestarts = createInfo->optimizeRestarts;
+	context->optimizeSeed = createInfo->optimizeSeed;
+	context->threadCount = createInfo->threadCount > 0 ?
+		(int32_t) createInfo->threadCount :
+		Cram_Internal_GetProcessorCount();
+
+	context->images = malloc(INITIAL_DATA_CAPACITY * sizeof(Cram_Image*));
+	context->imageCapacity = INITIAL_DATA_CAPACITY;
+	context->imageCount = 0;
+
+	context->imageMap = NULL;
+
+	context->pages = NULL;
+	context->pageCount = 0;
+	context->imageDatas = NULL;
+	context->imageDataCount = 0;
+
+	memset(&context->packStats, 0, sizeof(Cram_PackStats));
+
+	context->packAttempts = NULL;
+	context->packAttemptCount = 0;
+	context->packAttemptCapacity = 0;
+
+	context->livePacker = NULL;
+	context->liveImages = NULL;
+	context->liveImageCount = 0;
+	context->liveImageCapacity = 0;
+	context->firstFreeLiveImage = -1;
+
+	context->moves = NULL;
+	context->moveCount = 0;
+	context->moveCapacity = 0;
+
+	context->maxDimension = createInfo->maxDimension;
+
+	return (Cram_Context*) context;
+}
+
+/* Trims and hashes an image, copying the trimmed pixels unless they are borrowed.
+ * pixelStride is in pixels.
+ */
+static Cram_Image* Cram_Internal_CreateImage(
+	Cram_Internal_Context *context,
+	const char *name,
+	uint8_t *pixels,
+	int32_t width,
+	int32_t height,
+	int32_t pixelStride,
+	uint8_t borrow
+) {
+	Cram_Image *image;
+	Rect dstRect;
+
+	image = malloc(sizeof(Cram_Image));
+
+	image->path = strdup(name);
+
+	image->originalRect.x = 0;
+	image->originalRect.y = 0;
+	image->originalRect.w = width;
+	image->originalRect.h = height;
+
+	/* Check for trim */
+	if (context->trim)
+	{
+		Cram_Internal_GetOpaqueBounds((uint32_t*) pixels, width, height, pixelStride, &image->trimmedRect);
+	}
+	else
+	{
+		image->trimmedRect = image->originalRect;
+	}
+
+	if (borrow)
+	{
+		image->pixels = &pixels[Cram_Internal_GetPixelIndex(image->trimmedRect.x, image->trimmedRect.y, pixelStride) * 4];
+		image->pixelStride = pixelStride;
+	}
+	else
+	{
+		image->pixels = malloc(image->trimmedRect.w * image->trimmedRect.h * 4);
+		image->pixelStride = image->trimmedRect.w;
+
+		dstRect.x = 0;
+		dstRect.y = 0;
+		dstRect.w = image->trimmedRect.w;
+		dstRect.h = image->trimmedRect.h;
+		Cram_Internal_CopyPixels((uint32_t*) image->pixels, image->trimmedRect.w, (uint32_t*) pixels, pixelStride, &dstRect, &image->trimmedRect);
+	}
+
+	image->borrowed = borrow;
+
+	/* hash */
+	image->hash = Cram_Internal_HashPixels(image->pixels, image->pixelStride, image->trimmedRect.w, image->trimmedRect.h);
+
+	image->rotated = 0;
+	image->page = 0;
+	image->duplicateOf = NULL;
+
+	return image;
+}
+
+#ifdef __linux__
+
+/* stdio does many small reads per file, which adds up over thousands of small PNGs.
+ * Reads the whole file in one go, or maps it if it is big, and decodes from memory.
+ * Returns 0 if the file can't be read, so the caller can fall back to stbi_load.
+ * Once the file is read, *pPixels is NULL if it doesn't decode, and decoding it again wouldn't help.
+ */
+static uint8_t Cram_Internal_DecodeFile(const char *path, uint8_t **pPixels, int32_t *pWidth, int32_t *pHeight)
+{
+	struct stat fileStat;
+	uint8_t *data;
+	uint8_t readFile = 0;
+	int32_t numChannels;
+	ssize_t bytesRead;
+	size_t offset;
+	int fd;
+
+	*pPixels = NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0 || fileStat.st_size > INT32_MAX)
+	{
+		close(fd);
+		return 0;
+	}
+
+	if (fileStat.st_size < MMAP_THRESHOLD)
+	{
+		data = malloc(fileStat.st_size);
+		offset = 0;
+
+		while (offset < (size_t) fileStat.st_size)
+		{
+			bytesRead = pread(fd, data + offset, fileStat.st_size - offset, offset);
+			if (bytesRead <= 0)
+			{
+				break;
+			}
+			offset += bytesRead;
+		}
+
+		if (offset == (size_t) fileStat.st_size)
+		{
+			*pPixels = stbi_load_from_memory(data, (int) fileStat.st_size, pWidth, pHeight, &numChannels, STBI_rgb_alpha);
+			readFile = 1;
+		}
+
+		free(data);
+	}
+	else
+	{
+		data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data != MAP_FAILED)
+		{
+			madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+			*pPixels = stbi_load_from_memory(data, (int) fileStat.st_size, pWidth, pHeight, &numChannels, STBI_rgb_alpha);
+			munmap(data, fileStat.st_size);
+			readFile = 1;
+		}
+	}
+
+	close(fd);
+
+	return readFile;
+}
+
+#endif /* __linux__ */
+
+/* Returns NULL if the file can't be read or doesn't decode. */
+static Cram_Image* Cram_Internal_LoadImage(Cram_Internal_Context *context, const char *path)
+{
+	Cram_Image *image;
+	uint8_t *pixels;
+	int32_t width, height, numChannels;
+
+#ifdef __linux__
+	if (!Cram_Internal_DecodeFile(path, &pixels, &width, &height))
+	{
+		pixels = stbi_load(
+			path,
+			&width,
+			&height,
+			&numChannels,
+			STBI_rgb_alpha
+		);
+	}
+#else
+	pixels = stbi_load(
+		path,
+		&width,
+		&height,
+		&numChannels,
+		STBI_rgb_alpha
+	);
+#endif
+
+	if (pixels == NULL)
+	{
+		return NULL;
+	}
+
+	image = Cram_Internal_CreateImage(context, path, pixels, width, height, width, 0);
+	stbi_image_free(pixels);
+
+	return image;
+}
+
+/* Returns NULL if the data doesn't decode. */
+static Cram_Image* Cram_Internal_DecodeImage(Cram_Internal_Context *context, const char *name, const void *data, size_t length)
+{
+	Cram_Image *image;
+	uint8_t *pixels;
+	int32_t width, height, numChannels;
+
+	if (data == NULL || length == 0 || length > INT32_MAX)
+	{
+		return NULL;
+	}
+
+	pixels = stbi_load_from_memory(
+		(const stbi_uc*) data,
+		(int) length,
+		&width,
+		&height,
+		&numChannels,
+		STBI_rgb_alpha
+	);
+
+	if (pixels == NULL)
+	{
+		return NULL;
+	}
+
+	image = Cram_Internal_CreateImage(context, name, pixels, width, height, width, 0);
+	stbi_image_free(pixels);
+
+	return image;
+}
+
+static int Cram_Internal_IORead(void *user, char *data, int size)
+{
+	Cram_Internal_IOContext *ioContext = (Cram_Internal_IOContext*) user;
+	return ioContext->callbacks->read(ioContext->userdata, data, size);
+}
+
+static void Cram_Internal_IOSkip(void *user, int n)
+{
+	Cram_Internal_IOContext *ioContext = (Cram_Internal_IOContext*) user;
+	ioContext->callbacks->skip(ioContext->userdata, n);
+}
+
+static int Cram_Internal_IOEof(void *user)
+{
+	Cram_Internal_IOContext *ioContext = (Cram_Internal_IOContext*) user;
+	return ioContext->callbacks->eof(ioContext->userdata);
+}
+
+/* Dedup has to run in insertion order so the result doesn't depend on how loading was scheduled.
+ * Images that failed to load are NULL and are skipped.
+ */
+static void Cram_Internal_AddImage(Cram_Internal_Context *context, Cram_Image *image)
+{
+	Cram_Internal_ImageKey key;
+	Cram_Image *candidate;
+	ptrdiff_t mapIndex;
+
+	if (image == NULL)
+	{
+		return;
+	}
+
+	if (context->imageCapacity == context->imageCount)
+	{
+		context->imageCapacity *= 2;
+		context->images = realloc(context->images, context->imageCapacity * sizeof(Cram_Image*));
+	}
+
+	/* check if this is a duplicate */
+	key.hash = image->hash;
+	key.width = image->trimmedRect.w;
+	key.height = image->trimmedRect.h;
+
+	image->nextWithSameKey = NULL;
+	mapIndex = hmgeti(context->imageMap, key);
+
+	if (mapIndex >= 0)
+	{
+		for (candidate = context->imageMap[mapIndex].value; candidate != NULL; candidate = candidate->nextWithSameKey)
+		{
+			if (Cram_Internal_IsImageEqual(image, candidate))
+			{
+				/* this is duplicate data! */
+				image->duplicateOf = candidate;
+				if (!image->borrowed)
+				{
+					free(image->pixels);
+				}
+				image->pixels = NULL;
+				break;
+			}
+		}
+
+		if (!image->duplicateOf)
+		{
+			/* hash collision, chain it */
+			image->nextWithSameKey = context->imageMap[mapIndex].value;
+			context->imageMap[mapIndex].value = image;
+		}
+	}
+	else
+	{
+		hmput(context->imageMap, key, image);
+	}
+
+	context->images[context->imageCount] = image;
+	context->imageCount += 1;
+}
+
+static void Cram_Internal_LoadImageJob(void *userdata, int32_t index)
+{
+	Cram_Internal_LoadJob *loadJob = (Cram_Internal_LoadJob*) userdata;
+
+	if (loadJob->data != NULL)
+	{
+		loadJob->images[index] = Cram_Internal_DecodeImage(
+			loadJob->context,
+			loadJob->paths[index],
+			loadJob->data[index],
+			loadJob->lengths[index]
+		);
+	}
+	else
+	{
+		loadJob->images[index] = Cram_Internal_LoadImage(loadJob->context, loadJob->paths[index]);
+	}
+}
+
+static void Cram_Internal_ComposeImageJob(void *userdata, int32_t index)
+{
+	Cram_Internal_Context *context = (Cram_Internal_Context*) userdata;
+	Cram_Image *image = context->images[index];
+	Cram_Internal_Page *page;
+	Rect dstRect, srcRect;
+
+	if (image->duplicateOf)
+	{
+		return;
+	}
+
+	page = &context->pages[image->page];
+
+	if (image->rotated)
+	{
+		Cram_Internal_CopyPixelsRotated(
+			(uint32_t*) page->pixels,
+			page->width,
+			(uint32_t*) image->pixels,
+			image->pixelStride,
+			&image->packedRect,
+			&image->trimmedRect
+		);
+		return;
+	}
+
+	dstRect.x = image->packedRect.x;
+	dstRect.y = image->packedRect.y;
+	dstRect.w = image->trimmedRect.w;
+	dstRect.h = image->trimmedRect.h;
+
+	srcRect.x = 0;
+	srcRect.y = 0;
+	srcRect.w = image->trimmedRect.w;
+	srcRect.h = image->trimmedRect.h;
+
+	Cram_Internal_CopyPixels(
+		(uint32_t*) page->pixels,
+		page->width,
+		(uint32_t*) image->pixels,
+		image->pixelStride,
+		&dstRect,
+		&srcRect
+	);
+}
+
+/* Borrowed pixels are only valid until Cram_Pack returns, so they are copied before it does. */
+static void Cram_Internal_OwnBorrowedPixels(Cram_Internal_Context *context)
+{
+	Cram_Image *image;
+	uint8_t *pixels;
+	Rect rect;
+	int32_t i;
+
+	for (i = 0; i < context->imageCount; i += 1)
+	{
+		image = context->images[i];
+
+		if (!image->borrowed || image->duplicateOf)
+		{
+			continue;
+		}
+
+		rect.x = 0;
+		rect.y = 0;
+		rect.w = image->trimmedRect.w;
+		rect.h = image->trimmedRect.h;
+
+		pixels = malloc(rect.w * rect.h * 4);
+		Cram_Internal_CopyPixels((uint32_t*) pixels, rect.w, (uint32_t*) image->pixels, image->pixelStride, &rect, &rect);
+
+		image->pixels = pixels;
+		image->pixelStride = rect.w;
+		image->borrowed = 0;
+	}
+}
+
+void Cram_AddFile(Cram_Context *context, const char *path)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+
+	Cram_Internal_AddImage(
+		internalContext,
+		Cram_Internal_LoadImage(internalContext, path)
+	);
+}
+
+int8_t Cram_AddPixels(
+	Cram_Context *context,
+	const char *name,
+	uint8_t *pixels,
+	int32_t width,
+	int32_t height,
+	int32_t stride,
+	uint8_t borrow
+) {
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+
+	if (stride == 0)
+	{
+		stride = width * 4;
+	}
+
+	if (pixels == NULL || width <= 0 || height <= 0 || stride < width * 4 || stride % 4 != 0)
+	{
+		return -1;
+	}
+
+	Cram_Internal_AddImage(
+		internalContext,
+		Cram_Internal_CreateImage(internalContext, name, pixels, width, height, stride / 4, borrow)
+	);
+
+	return 0;
+}
+
+int8_t Cram_AddEncoded(Cram_Context *context, const char *name, const void *data, size_t length)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Image *image = Cram_Internal_DecodeImage(internalContext, name, data, length);
+
+	if (image == NULL)
+	{
+		return -1;
+	}
+
+	Cram_Internal_AddImage(internalContext, image);
+
+	return 0;
+}
+
+int8_t Cram_AddEncodedFromCallbacks(
+	Cram_Context *context,
+	const char *name,
+	const Cram_IOCallbacks *callbacks,
+	void *userdata
+) {
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_IOContext ioContext;
+	stbi_io_callbacks stbiCallbacks;
+	uint8_t *pixels;
+	int32_t width, height, numChannels;
+
+	ioContext.callbacks = callbacks;
+	ioContext.userdata = userdata;
+
+	stbiCallbacks.read = Cram_Internal_IORead;
+	stbiCallbacks.skip = Cram_Internal_IOSkip;
+	stbiCallbacks.eof = Cram_Internal_IOEof;
+
+	pixels = stbi_load_from_callbacks(
+		&stbiCallbacks,
+		&ioContext,
+		&width,
+		&height,
+		&numChannels,
+		STBI_rgb_alpha
+	);
+
+	if (pixels == NULL)
+	{
+		return -1;
+	}
+
+	Cram_Internal_AddImage(
+		internalContext,
+		Cram_Internal_CreateImage(internalContext, name, pixels, width, height, width, 0)
+	);
+
+	stbi_image_free(pixels);
+
+	return 0;
+}
+
+void Cram_AddFiles(Cram_Context *context, const char **paths, int32_t pathCount)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_LoadJob loadJob;
+	int32_t i;
+
+	if (pathCount <= 0)
+	{
+		return;
+	}
+
+	loadJob.context = internalContext;
+	loadJob.paths = paths;
+	loadJob.data = NULL;
+	loadJob.lengths = NULL;
+	loadJob.images = malloc(sizeof(Cram_Image*) * pathCount);
+
+	/* decode, trim and hash in parallel... */
+	Cram_Internal_ParallelFor(
+		internalContext->threadCount,
+		pathCount,
+		Cram_Internal_LoadImageJob,
+		&loadJob
+	);
+
+	/* ...then dedup and insert in order, exactly as if AddFile had been called for each path */
+	for (i = 0; i < pathCount; i += 1)
+	{
+		Cram_Internal_AddImage(internalContext, loadJob.images[i]);
+	}
+
+	free(loadJob.images);
+}
+
+int8_t Cram_AddEncodedBatch(
+	Cram_Context *context,
+	const char **names,
+	const void **data,
+	const size_t *lengths,
+	int32_t count
+) {
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_LoadJob loadJob;
+	int8_t result = 0;
+	int32_t i;
+
+	if (count <= 0)
+	{
+		return 0;
+	}
+
+	loadJob.context = internalContext;
+	loadJob.paths = names;
+	loadJob.data = data;
+	loadJob.lengths = lengths;
+	loadJob.images = malloc(sizeof(Cram_Image*) * count);
+
+	Cram_Internal_ParallelFor(
+		internalContext->threadCount,
+		count,
+		Cram_Internal_LoadImageJob,
+		&loadJob
+	);
+
+	for (i = 0; i < count; i += 1)
+	{
+		if (loadJob.images[i] == NULL)
+		{
+			result = -1;
+			continue;
+		}
+
+		Cram_Internal_AddImage(internalContext, loadJob.images[i]);
+	}
+
+	free(loadJob.images);
+
+	return result;
+}
+
+/* Drops every inserted image. The packer is rebuilt from the first page on the next insert. */
+static void Cram_Internal_ResetLiveImages(Cram_Internal_Context *context)
+{
+	if (context->livePacker != NULL)
+	{
+		Cram_Internal_DestroyRectPacker(context->livePacker);
+		context->livePacker = NULL;
+	}
+
+	context->liveImageCount = 0;
+	context->firstFreeLiveImage = -1;
+}
+
+/* Whatever Cram_Pack put on the first page stays where it is. */
+static void Cram_Internal_PlacePackedImages(Cram_Internal_Context *context, RectPackContext *packer)
+{
+	Cram_ImageData *imageData;
+	Rect rect;
+	int32_t i;
+
+	for (i = 0; i < context->imageDataCount; i += 1)
+	{
+		imageData = &context->imageDatas[i];
+
+		/* duplicates share the rect of the image they duplicate */
+		if (imageData->page == 0 && !context->images[i]->duplicateOf)
+		{
+			rect.x = imageData->x;
+			rect.y = imageData->y;
+			rect.w = imageData->width + context->padding;
+			rect.h = imageData->height + context->padding;
+
+			Cram_Internal_PlaceRect(packer, &rect);
+		}
+	}
+}
+
+/* Returns 0 if the first page can't be allocated. */
+static uint8_t Cram_Internal_InitLivePacker(Cram_Internal_Context *context)
+{
+	uint8_t *pixels;
+	int32_t side;
+
+	context->liveGrows = context->growInPlace;
+
+	if (context->pageCount == 0)
+	{
+		/* start small and grow, a glyph cache shouldn't cost maxDimension squared up front */
+		side = min(INITIAL_DIMENSION, context->maxDimension);
+
+		pixels = calloc(side * side, 4);
+		if (pixels == NULL)
+		{
+			return 0;
+		}
+
+		context->pages = malloc(sizeof(Cram_Internal_Page));
+		context->pages[0].width = side;
+		context->pages[0].height = side;
+		context->pages[0].pixels = pixels;
+		context->pageCount = 1;
+		context->liveGrows = 1;
+	}
+
+	context->livePacker = Cram_Internal_InitRectPacker(
+		context->pages[0].width,
+		context->pages[0].height,
+		context->heuristic == CRAM_HEURISTIC_AUTO ? CRAM_HEURISTIC_BEST_AREA_FIT : context->heuristic,
+		0
+	);
+
+	Cram_Internal_PlacePackedImages(context, context->livePacker);
+
+	return 1;
+}
+
+/* Doubles the shorter side of the first page, up to maxDimension. Returns 0 if it can't grow. */
+static uint8_t Cram_Internal_GrowLivePage(Cram_Internal_Context *context)
+{
+	Cram_Internal_Page *page = &context->pages[0];
+	Cram_ImageData *imageData;
+	Rect rect;
+	uint8_t *pixels;
+	int32_t width = page->width;
+	int32_t height = page->height;
+	int32_t j;
+
+	if (width <= height)
+	{
+		width = min(width * 2, context->maxDimension);
+	}
+
+	if (width == page->width)
+	{
+		height = min(height * 2, context->maxDimension);
+	}
+
+	if (width == page->width && height == page->height)
+	{
+		return 0;
+	}
+
+	pixels = calloc(width * height, 4);
+	if (pixels == NULL)
+	{
+		return 0;
+	}
+
+	for (j = 0; j < page->height; j += 1)
+	{
+		memcpy(&pixels[j * width * 4], &page->pixels[j * page->width * 4], page->width * 4);
+	}
+
+	Cram_Internal_GrowRectPacker(context->livePacker, width, height);
+
+	/* padding can hang over the old edge of a cropped page, and the new space there isn't free */
+	for (j = 0; j < context->imageDataCount; j += 1)
+	{
+		imageData = &context->imageDatas[j];
+
+		rect.x = imageData->x;
+		rect.y = imageData->y;
+		rect.w = imageData->width + context->padding;
+		rect.h = imageData->height + context->padding;
+
+		if (	imageData->page == 0 &&
+				!context->images[j]->duplicateOf &&
+				(rect.x + rect.w > page->width || rect.y + rect.h > page->height)	)
+		{
+			Cram_Internal_PlaceRect(context->livePacker, &rect);
+		}
+	}
+
+	free(page->pixels);
+	page->pixels = pixels;
+	page->width = width;
+	page->height = height;
+
+	return 1;
+}
+
+int8_t Cram_Pack(Cram_Context *context)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_PagePack *pagePacks;
+	Cram_Internal_PageJob pageJob;
+	Cram_Internal_Page *page;
+	Rect *packerRects;
+	int32_t *rectImages; /* image index of each packer rect */
+	int32_t *rectPages;
+	Rect *assignedRects = NULL;
+	int32_t numRects = 0;
+	int32_t pageCount, pageWidth, pageHeight;
+	int8_t result = 0;
+	Rect *packerRect;
+	Cram_Image *image;
+	int32_t i, j;
+
+	for (i = 0; i < internalContext->imageCount; i += 1)
+	{
+		if (!internalContext->images[i]->duplicateOf)
+		{
+			numRects += 1;
+		}
+	}
+
+	packerRects = malloc(sizeof(Rect) * numRects);
+	rectImages = malloc(sizeof(int32_t) * numRects);
+	rectPages = malloc(sizeof(int32_t) * numRects);
+
+	numRects = 0;
+	for (i = 0; i < internalContext->imageCount; i += 1)
+	{
+		if (!internalContext->images[i]->duplicateOf)
+		{
+			packerRect = &packerRects[numRects];
+
+			packerRect->w = internalContext->images[i]->trimmedRect.w + internalContext->padding;
+			packerRect->h = internalContext->images[i]->trimmedRect.h + internalContext->padding;
+
+			rectImages[numRects] = i;
+			rectPages[numRects] = 0;
+
+			numRects += 1;
+		}
+	}
+
+	internalContext->packAttemptCount = 0;
+	memset(&internalContext->packStats, 0, sizeof(Cram_PackStats));
+
+	/* Try to fit everything on one page first. */
+	pageCount = 1;
+	pagePacks = malloc(sizeof(Cram_Internal_PagePack));
+	Cram_Internal_InitPagePacks(pagePacks, pageCount, packerRects, numRects, rectPages);
+	Cram_Internal_SearchPackSize(internalContext, &pagePacks[0], internalContext->threadCount);
+
+	if (pagePacks[0].result < 0 && internalContext->multiPage)
+	{
+		Cram_Internal_ReleasePagePack(internalContext, &pagePacks[0]);
+
+		assignedRects = malloc(sizeof(Rect) * numRects);
+		pageCount = Cram_Internal_AssignPages(internalContext, packerRects, numRects, rectPages, assignedRects, &pageWidth, &pageHeight);
+
+		if (pageCount > 0)
+		{
+			/* every page is shrunk to fit independently */
+			pagePacks = realloc(pagePacks, sizeof(Cram_Internal_PagePack) * pageCount);
+			Cram_Internal_InitPagePacks(pagePacks, pageCount, packerRects, numRects, rectPages);
+
+			pageJob.context = internalContext;
+			pageJob.pagePacks = pagePacks;
+
+			Cram_Internal_ParallelFor(
+				internalContext->threadCount,
+				pageCount,
+				Cram_Internal_PackPageJob,
+				&pageJob
+			);
+		}
+	}
+
+	if (pageCount < 0)
+	{
+		result = -1;
+		pageCount = 0;
+	}
+
+	for (i = 0; i < pageCount; i += 1)
+	{
+		if (pagePacks[i].result < 0)
+		{
+			if (assignedRects == NULL)
+			{
+				result = -1;
+				continue;
+			}
+
+			/* Packed on its own the page can come out differently, and not fit.
+			 * The layout it was filled with always does.
+			 */
+			for (j = 0; j < pagePacks[i].numRects; j += 1)
+			{
+				pagePacks[i].rects[j] = assignedRects[pagePacks[i].rectIndices[j]];
+			}
+
+			Cram_Internal_GetOutputSize(
+				internalContext->sizeMode,
+				pagePacks[i].rects,
+				pagePacks[i].numRects,
+				internalContext->padding,
+				pageWidth,
+				pageHeight,
+				&pagePacks[i].width,
+				&pagePacks[i].height
+			);
+		}
+
+		for (j = 0; j < pagePacks[i].numRects; j += 1)
+		{
+			packerRects[pagePacks[i].rectIndices[j]] = pagePacks[i].rects[j];
+		}
+	}
+
+	if (result == 0)
+	{
+		for (i = pageCount; i < internalContext->pageCount; i += 1)
+		{
+			free(internalContext->pages[i].pixels);
+		}
+
+		internalContext->pages = realloc(internalContext->pages, sizeof(Cram_Internal_Page) * pageCount);
+
+		for (i = internalContext->pageCount; i < pageCount; i += 1)
+		{
+			internalContext->pages[i].pixels = NULL;
+		}
+
+		internalContext->pageCount = pageCount;
+
+		for (i = 0; i < pageCount; i += 1)
+		{
+			page = &internalContext->pages[i];
+			page->width = pagePacks[i].width;
+			page->height = pagePacks[i].height;
+			page->pixels = realloc(page->pixels, page->width * page->height * 4);
+			memset(page->pixels, 0, page->width * page->height * 4);
+		}
+	}
+
+	for (i = 0; i < pageCount; i += 1)
+	{
+		Cram_Internal_ReleasePagePack(internalContext, &pagePacks[i]);
+	}
+	free(pagePacks);
+
+	if (result < 0)
+	{
+		/* Can't pack into max dimensions, abort! */
+		Cram_Internal_OwnBorrowedPixels(internalContext);
+		free(packerRects);
+		free(rectImages);
+		free(rectPages);
+		free(assignedRects);
+		return -1;
+	}
+
+	/* the pages are about to be redrawn from scratch */
+	Cram_Internal_ResetLiveImages(internalContext);
+
+	for (i = 0; i < numRects; i += 1)
+	{
+		packerRect = &packerRects[i];
+		image = internalContext->images[rectImages[i]];
+
+		/* the packer swaps the sides of the rects it rotates */
+		image->rotated = packerRect->w != image->trimmedRect.w + internalContext->padding;
+		image->page = rectPages[i];
+
+		image->packedRect.x = packerRect->x;
+		image->packedRect.y = packerRect->y;
+		image->packedRect.w = image->rotated ? image->trimmedRect.h : image->trimmedRect.w;
+		image->packedRect.h = image->rotated ? image->trimmedRect.w : image->trimmedRect.h;
+	}
+
+	/* packed rects never overlap, so images can be blitted concurrently, across pages too */
+	Cram_Internal_ParallelFor(
+		internalContext->threadCount,
+		internalContext->imageCount,
+		Cram_Internal_ComposeImageJob,
+		internalContext
+	);
+
+	Cram_Internal_OwnBorrowedPixels(internalContext);
+
+	for (i = 0; i < internalContext->imageDataCount; i += 1)
+	{
+		free(internalContext->imageDatas[i].path);
+	}
+
+	internalContext->imageDataCount = internalContext->imageCount;
+	internalContext->imageDatas = realloc(internalContext->imageDatas, sizeof(Cram_ImageData) * internalContext->imageDataCount);
+
+	for (i = 0; i < internalContext->imageCount; i += 1)
+	{
+		image = internalContext->images[i]->duplicateOf ?
+			internalContext->images[i]->duplicateOf :
+			internalContext->images[i];
+
+		internalContext->imageDatas[i].x = image->packedRect.x;
+		internalContext->imageDatas[i].y = image->packedRect.y;
+		internalContext->imageDatas[i].width = image->packedRect.w;
+		internalContext->imageDatas[i].height = image->packedRect.h;
+		internalContext->imageDatas[i].rotated = image->rotated;
+		internalContext->imageDatas[i].page = image->page;
+
+		image = internalContext->images[i];
+
+		internalContext->imageDatas[i].trimOffsetX = image->originalRect.x - image->trimmedRect.x;
+		internalContext->imageDatas[i].trimOffsetY = image->originalRect.y - image->trimmedRect.y;
+		internalContext->imageDatas[i].untrimmedWidth = image->originalRect.w;
+		internalContext->imageDatas[i].untrimmedHeight = image->originalRect.h;
+
+		internalContext->imageDatas[i].path = strdup(internalContext->images[i]->path);
+	}
+
+	free(packerRects);
+	free(rectImages);
+	free(rectPages);
+	free(assignedRects);
+
+	return 0;
+}
+
+uint32_t Cram_Insert(Cram_Context *context, uint8_t *pixels, int32_t width, int32_t height, Cram_Region *pDirtyRegion)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_LiveImage *liveImage;
+	Cram_Internal_Page *page;
+	Rect rect, dstRect, srcRect;
+	int32_t index;
+	uint8_t grown = 0;
+
+	if (width <= 0 || height <= 0)
+	{
+		return 0;
+	}
+
+	if (internalContext->livePacker == NULL && !Cram_Internal_InitLivePacker(internalContext))
+	{
+		return 0;
+	}
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = width + internalContext->padding;
+	rect.h = height + internalContext->padding;
+
+	while (Cram_Internal_PackMaxRects(internalContext->livePacker, &rect, 1) < 0)
+	{
+		if (!internalContext->liveGrows || !Cram_Internal_GrowLivePage(internalContext))
+		{
+			return 0;
+		}
+
+		grown = 1;
+	}
+
+	if (internalContext->firstFreeLiveImage >= 0)
+	{
+		index = internalContext->firstFreeLiveImage;
+		internalContext->firstFreeLiveImage = internalContext->liveImages[index].nextFree;
+	}
+	else
+	{
+		if (internalContext->liveImageCount == internalContext->liveImageCapacity)
+		{
+			internalContext->liveImageCapacity = max(internalContext->liveImageCapacity * 2, INITIAL_DATA_CAPACITY);
+			internalContext->liveImages = realloc(internalContext->liveImages, sizeof(Cram_Internal_LiveImage) * internalContext->liveImageCapacity);
+		}
+
+		index = internalContext->liveImageCount;
+		internalContext->liveImageCount += 1;
+	}
+
+	liveImage = &internalContext->liveImages[index];
+	liveImage->rect = rect;
+	liveImage->used = 1;
+
+	page = &internalContext->pages[0];
+
+	dstRect.x = rect.x;
+	dstRect.y = rect.y;
+	dstRect.w = width;
+	dstRect.h = height;
+
+	srcRect.x = 0;
+	srcRect.y = 0;
+	srcRect.w = width;
+	srcRect.h = height;
+
+	Cram_Internal_CopyPixels(
+		(uint32_t*) page->pixels,
+		page->width,
+		(uint32_t*) pixels,
+		width,
+		&dstRect,
+		&srcRect
+	);
+
+	if (pDirtyRegion != NULL)
+	{
+		if (grown)
+		{
+			/* the page changed size, so all of it has to go up again */
+			pDirtyRegion->x = 0;
+			pDirtyRegion->y = 0;
+			pDirtyRegion->width = page->width;
+			pDirtyRegion->height = page->height;
+		}
+		else
+		{
+			pDirtyRegion->x = dstRect.x;
+			pDirtyRegion->y = dstRect.y;
+			pDirtyRegion->width = dstRect.w;
+			pDirtyRegion->height = dstRect.h;
+		}
+	}
+
+	return index + 1;
+}
+
+int8_t Cram_Remove(Cram_Context *context, uint32_t handle, Cram_Region *pDirtyRegion)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_LiveImage *liveImage;
+	Cram_Internal_Page *page;
+	Rect dstRect;
+	int32_t index;
+
+	/* compare unsigned so a handle past INT32_MAX can't wrap to a negative index */
+	if (handle == 0 || handle > (uint32_t) internalContext->liveImageCount || !internalContext->liveImages[handle - 1].used)
+	{
+		return -1;
+	}
+
+	index = (int32_t) handle - 1;
+
+	liveImage = &internalContext->liveImages[index];
+
+	Cram_Internal_ReleaseRect(internalContext->livePacker, &liveImage->rect);
+
+	page = &internalContext->pages[0];
+
+	dstRect.x = liveImage->rect.x;
+	dstRect.y = liveImage->rect.y;
+	dstRect.w = liveImage->rect.w - internalContext->padding;
+	dstRect.h = liveImage->rect.h - internalContext->padding;
+
+	Cram_Internal_ClearPixels((uint32_t*) page->pixels, page->width, &dstRect);
 
-		/* plug the hole */
-		rectsToPack[bestRectIndex] = rectsToPack[rectsToPackCount - 1];
-		rectsToPackCount -= 1;
+	if (pDirtyRegion != NULL)
+	{
+		pDirtyRegion->x = dstRect.x;
+		pDirtyRegion->y = dstRect.y;
+		pDirtyRegion->width = dstRect.w;
+		pDirtyRegion->height = dstRect.h;
 	}
 
-	free(rectsToPack);
+	liveImage->used = 0;
+	liveImage->nextFree = internalContext->firstFreeLiveImage;
+	internalContext->firstFreeLiveImage = index;
+
 	return 0;
 }
 
-/* API functions */
-
-uint32_t Cram_LinkedVersion(void)
+int8_t Cram_GetRegion(Cram_Context *context, uint32_t handle, Cram_Region *pRegion)
 {
-	return CRAM_COMPILED_VERSION;
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_LiveImage *liveImage;
+	int32_t index;
+
+	/* compare unsigned so a handle past INT32_MAX can't wrap to a negative index */
+	if (handle == 0 || handle > (uint32_t) internalContext->liveImageCount || !internalContext->liveImages[handle - 1].used)
+	{
+		return -1;
+	}
+
+	index = (int32_t) handle - 1;
+
+	liveImage = &internalContext->liveImages[index];
+
+	pRegion->x = liveImage->rect.x;
+	pRegion->y = liveImage->rect.y;
+	pRegion->width = liveImage->rect.w - internalContext->padding;
+	pRegion->height = liveImage->rect.h - internalContext->padding;
+
+	return 0;
 }
 
-Cram_Context* Cram_Init(Cram_ContextCreateInfo *createInfo)
+static uint8_t Cram_Internal_Overlaps(Rect *a, Rect *b)
 {
-	Cram_Internal_Context *context = malloc(sizeof(Cram_Internal_Context));
+	return	a->x < b->x + b->w &&
+			b->x < a->x + a->w &&
+			a->y < b->y + b->h &&
+			b->y < a->y + a->h;
+}
 
-	context->name = strdup(createInfo->name);
+/* Moves an image within a page. The old spot is cleared, and must not overlap the new one. */
+static void Cram_Internal_MovePixels(Cram_Internal_Page *page, Rect *srcRect, Rect *dstRect)
+{
+	Cram_Internal_CopyPixels((uint32_t*) page->pixels, page->width, (uint32_t*) page->pixels, page->width, dstRect, srcRect);
+	Cram_Internal_ClearPixels((uint32_t*) page->pixels, page->width, srcRect);
+}
 
-	context->padding = createInfo->padding;
-	context->trim = createInfo->trim;
+/* Moves a live image to x, y and records the move. */
+static void Cram_Internal_CompactMove(Cram_Internal_Context *context, int32_t index, int32_t x, int32_t y)
+{
+	Cram_Internal_LiveImage *liveImage = &context->liveImages[index];
+	Cram_Move *move;
+	Rect srcRect, dstRect;
 
-	context->images = malloc(INITIAL_DATA_CAPACITY * sizeof(Cram_Image*));
-	context->imageCapacity = INITIAL_DATA_CAPACITY;
-	context->imageCount = 0;
+	srcRect.x = liveImage->rect.x;
+	srcRect.y = liveImage->rect.y;
+	srcRect.w = liveImage->rect.w - context->padding;
+	srcRect.h = liveImage->rect.h - context->padding;
 
-	context->pixels = NULL;
-	context->imageDatas = NULL;
-	context->imageDataCount = 0;
+	dstRect.x = x;
+	dstRect.y = y;
+	dstRect.w = srcRect.w;
+	dstRect.h = srcRect.h;
 
-	context->packedWidth = 0;
-	context->packedHeight = 0;
+	Cram_Internal_MovePixels(&context->pages[0], &srcRect, &dstRect);
 
-	context->maxDimension = createInfo->maxDimension;
+	if (context->moveCount == context->moveCapacity)
+	{
+		context->moveCapacity = max(context->moveCapacity * 2, INITIAL_DATA_CAPACITY);
+		context->moves = realloc(context->moves, sizeof(Cram_Move) * context->moveCapacity);
+	}
 
-	return (Cram_Context*) context;
+	move = &context->moves[context->moveCount];
+	move->handle = index + 1;
+	move->source.x = srcRect.x;
+	move->source.y = srcRect.y;
+	move->source.width = srcRect.w;
+	move->source.height = srcRect.h;
+	move->destination.x = dstRect.x;
+	move->destination.y = dstRect.y;
+	move->destination.width = dstRect.w;
+	move->destination.height = dstRect.h;
+	context->moveCount += 1;
+
+	liveImage->rect.x = x;
+	liveImage->rect.y = y;
 }
 
-void Cram_AddFile(Cram_Context *context, const char *path)
+/* Where Cram_Compact is headed. Indices are into targets, not liveImages. */
+typedef struct Cram_Internal_Compaction
 {
-	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
-	Cram_Image *image;
-	uint8_t *pixels;
-	int32_t leftTrim, topTrim, rightTrim, bottomTrim;
-	int32_t width, height, numChannels;
+	Rect *targets;
+	int32_t *targetImages; /* live image index of each target */
+	int32_t *blockerCounts; /* images other than its own sitting on each target */
+	int32_t *blockingCounts; /* other targets each image is sitting on */
+	uint8_t *done;
+	int32_t targetCount;
+
+	int32_t *ready; /* stack of targets nobody else is sitting on */
+	int32_t readyCount;
+
+	/* Space that is clear of every image and every pending target, built on demand.
+	 * An image staged there is in nobody's way, so it is never staged twice.
+	 */
+	RectPackContext *stagingPacker;
+	uint8_t stagingFresh; /* nothing moved since it was built */
+	uint8_t stagingRebuilt;
+} Cram_Internal_Compaction;
+
+static void Cram_Internal_BuildStagingPacker(Cram_Internal_Context *context, Cram_Internal_Compaction *compaction)
+{
+	Cram_Internal_Page *page = &context->pages[0];
 	int32_t i;
 
-	if (internalContext->imageCapacity == internalContext->imageCount)
+	if (compaction->stagingPacker != NULL)
 	{
-		internalContext->imageCapacity *= 2;
-		internalContext->images = realloc(internalContext->images, internalContext->imageCapacity * sizeof(Cram_Image*));
+		Cram_Internal_DestroyRectPacker(compaction->stagingPacker);
 	}
 
-	image = malloc(sizeof(Cram_Image));
-
-	image->path = strdup(path);
-
-	pixels = stbi_load(
-		path,
-		&width,
-		&height,
-		&numChannels,
-		STBI_rgb_alpha
+	/* only its free list is used */
+	compaction->stagingPacker = Cram_Internal_InitRectPacker(
+		page->width,
+		page->height,
+		CRAM_HEURISTIC_BEST_AREA_FIT,
+		0
 	);
 
-	image->originalRect.x = 0;
-	image->originalRect.y = 0;
-	image->originalRect.w = width;
-	image->originalRect.h = height;
+	Cram_Internal_PlacePackedImages(context, compaction->stagingPacker);
 
-	/* Check for trim */
-	if (internalContext->trim)
+	for (i = 0; i < context->liveImageCount; i += 1)
 	{
-		topTrim = 0;
-		for (i = 0; i < height; i += 1)
+		if (context->liveImages[i].used)
 		{
-			if (!Cram_Internal_IsRowClear((uint32_t*) pixels, i, width))
-			{
-				topTrim = i;
-				break;
-			}
+			Cram_Internal_PlaceRect(compaction->stagingPacker, &context->liveImages[i].rect);
 		}
+	}
 
-		leftTrim = 0;
-		for (i = 0; i < width; i += 1)
+	for (i = 0; i < compaction->targetCount; i += 1)
+	{
+		if (!compaction->done[i])
 		{
-			if (!Cram_Internal_IsColumnClear((uint32_t*) pixels, i, width, height))
-			{
-				leftTrim = i;
-				break;
-			}
+			Cram_Internal_PlaceRect(compaction->stagingPacker, &compaction->targets[i]);
 		}
+	}
+
+	compaction->stagingFresh = 1;
+}
+
+/* Released rects don't join up with all the free space around them, so when nothing fits
+ * it is worth looking again from scratch. That costs about as much as a pack, so it happens
+ * at most once per call on top of the first build. Returns 1 if it rebuilt the free list.
+ */
+static uint8_t Cram_Internal_RefreshStagingPacker(Cram_Internal_Context *context, Cram_Internal_Compaction *compaction)
+{
+	if (compaction->stagingFresh || compaction->stagingRebuilt)
+	{
+		return 0;
+	}
+
+	Cram_Internal_BuildStagingPacker(context, compaction);
+	compaction->stagingRebuilt = 1;
+
+	return 1;
+}
+
+/* ReleaseRect only hands back rect itself, but the space a staged image needs is often
+ * a vacated spot together with its neighbours. So rect is also stretched across free rects that line up with it.
+ */
+static void Cram_Internal_ReleaseStagingRect(RectPackContext *packer, Rect *rect)
+{
+	Rect *merged;
+	Rect *freeRect;
+	int32_t mergedCount = 0;
+	int32_t i;
+
+	Cram_Internal_ReleaseRect(packer, rect);
+
+	merged = malloc(sizeof(Rect) * packer->freeRectangleCount * 2);
+
+	for (i = 0; i < packer->freeRectangleCount; i += 1)
+	{
+		freeRect = &packer->freeRectangles[i];
 
-		bottomTrim = height;
-		for (i = height - 1; i >= topTrim; i -= 1)
+		/* side by side, across the rows the shorter of the two covers */
+		if (freeRect->x <= rect->x + rect->w && freeRect->x + freeRect->w >= rect->x)
 		{
-			if (!Cram_Internal_IsRowClear((uint32_t*) pixels, i, width))
+			merged[mergedCount].x = min(freeRect->x, rect->x);
+			merged[mergedCount].w = max(freeRect->x + freeRect->w, rect->x + rect->w) - merged[mergedCount].x;
+
+			if (freeRect->y <= rect->y && freeRect->y + freeRect->h >= rect->y + rect->h)
 			{
-				bottomTrim = i + 1;
-				break;
+				merged[mergedCount].y = rect->y;
+				merged[mergedCount].h = rect->h;
+				mergedCount += 1;
+			}
+			else if (rect->y <= freeRect->y && rect->y + rect->h >= freeRect->y + freeRect->h)
+			{
+				merged[mergedCount].y = freeRect->y;
+				merged[mergedCount].h = freeRect->h;
+				mergedCount += 1;
 			}
 		}
 
-		rightTrim = width;
-		for (i = width - 1; i >= leftTrim; i -= 1)
+		/* one above the other */
+		if (freeRect->y <= rect->y + rect->h && freeRect->y + freeRect->h >= rect->y)
 		{
-			if (!Cram_Internal_IsColumnClear((uint32_t*) pixels, i, width, height))
+			merged[mergedCount].y = min(freeRect->y, rect->y);
+			merged[mergedCount].h = max(freeRect->y + freeRect->h, rect->y + rect->h) - merged[mergedCount].y;
+
+			if (freeRect->x <= rect->x && freeRect->x + freeRect->w >= rect->x + rect->w)
 			{
-				rightTrim = i + 1;
-				break;
+				merged[mergedCount].x = rect->x;
+				merged[mergedCount].w = rect->w;
+				mergedCount += 1;
+			}
+			else if (rect->x <= freeRect->x && rect->x + rect->w >= freeRect->x + freeRect->w)
+			{
+				merged[mergedCount].x = freeRect->x;
+				merged[mergedCount].w = freeRect->w;
+				mergedCount += 1;
 			}
 		}
-
-		image->trimmedRect.x = leftTrim;
-		image->trimmedRect.y = topTrim;
-		image->trimmedRect.w = rightTrim - leftTrim;
-		image->trimmedRect.h = bottomTrim - topTrim;
 	}
-	else
+
+	for (i = 0; i < mergedCount; i += 1)
 	{
-		image->trimmedRect = image->originalRect;
+		Cram_Internal_ReleaseRect(packer, &merged[i]);
 	}
 
-	/* copy and free source pixels */
-	image->pixels = malloc(image->trimmedRect.w * image->trimmedRect.h * 4);
+	free(merged);
+}
 
-	Rect dstRect;
-	dstRect.x = 0;
-	dstRect.y = 0;
-	dstRect.w = image->trimmedRect.w;
-	dstRect.h = image->trimmedRect.h;
-	Cram_Internal_CopyPixels((uint32_t*) image->pixels, image->trimmedRect.w, (uint32_t*) pixels, width, &dstRect, &image->trimmedRect);
-	stbi_image_free(pixels);
+/* Moves the image of target index to x, y, clear of every other pending target, and updates who is in whose way. */
+static void Cram_Internal_CompactionMove(Cram_Internal_Context *context, Cram_Internal_Compaction *compaction, int32_t index, int32_t x, int32_t y)
+{
+	Cram_Internal_LiveImage *liveImage = &context->liveImages[compaction->targetImages[index]];
+	Rect oldRect = liveImage->rect;
+	int32_t i;
 
-	/* hash */
-	image->hash = stbds_hash_bytes(image->pixels, image->trimmedRect.w * image->trimmedRect.h * 4, 0);
+	Cram_Internal_CompactMove(context, compaction->targetImages[index], x, y);
 
-	/* check if this is a duplicate */
-	image->duplicateOf = NULL;
-	for (i = 0; i < internalContext->imageCount; i += 1)
+	if (compaction->stagingPacker != NULL)
 	{
-		if (!internalContext->images[i]->duplicateOf)
+		Cram_Internal_ReleaseStagingRect(compaction->stagingPacker, &oldRect);
+		Cram_Internal_PlaceRect(compaction->stagingPacker, &liveImage->rect);
+		compaction->stagingFresh = 0;
+	}
+
+	for (i = 0; i < compaction->targetCount; i += 1)
+	{
+		if (!compaction->done[i] && Cram_Internal_Overlaps(&compaction->targets[i], &oldRect))
 		{
-			if (Cram_Internal_IsImageEqual(image, internalContext->images[i]))
+			/* the vacated spot is free, but pending targets in it stay off limits for staging */
+			if (compaction->stagingPacker != NULL)
 			{
-				/* this is duplicate data! */
-				image->duplicateOf = internalContext->images[i];
-				free(image->pixels);
-				image->pixels = NULL;
-				break;
+				Cram_Internal_PlaceRect(compaction->stagingPacker, &compaction->targets[i]);
+			}
+
+			if (i != index)
+			{
+				compaction->blockerCounts[i] -= 1;
+
+				if (compaction->blockerCounts[i] == 0)
+				{
+					compaction->ready[compaction->readyCount] = i;
+					compaction->readyCount += 1;
+				}
 			}
 		}
 	}
 
-	internalContext->images[internalContext->imageCount] = image;
-	internalContext->imageCount += 1;
+	compaction->blockingCounts[index] = 0;
 }
 
-int8_t Cram_Pack(Cram_Context *context)
+/* Best area fit over the free list. */
+static uint8_t Cram_Internal_FindStagingRect(RectPackContext *packer, Rect *rect)
 {
-	RectPackContext *rectPackContext;
-	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
-	Rect *packerRects;
-	uint32_t numRects = 0;
-	Rect *packerRect;
-	Rect dstRect, srcRect;
-	Cram_Image *image;
-	uint8_t increaseX = 1;
+	Rect *freeRect;
+	int32_t bestArea = INT32_MAX;
 	int32_t i;
 
-	internalContext->imageDataCount = internalContext->imageCount;
-	internalContext->imageDatas = realloc(internalContext->imageDatas, sizeof(Cram_ImageData) * internalContext->imageDataCount);
-
-	rectPackContext = Cram_Internal_InitRectPacker(INITIAL_DIMENSION, INITIAL_DIMENSION);
-
-	for (i = 0; i < internalContext->imageCount; i += 1)
+	for (i = 0; i < packer->freeRectangleCount; i += 1)
 	{
-		if (!internalContext->images[i]->duplicateOf)
+		freeRect = &packer->freeRectangles[i];
+
+		if (freeRect->w >= rect->w && freeRect->h >= rect->h && freeRect->w * freeRect->h < bestArea)
 		{
-			numRects += 1;
+			bestArea = freeRect->w * freeRect->h;
+			rect->x = freeRect->x;
+			rect->y = freeRect->y;
 		}
 	}
 
-	packerRects = malloc(sizeof(Rect) * numRects);
+	return bestArea != INT32_MAX;
+}
 
-	numRects = 0;
-	for (i = 0; i < internalContext->imageCount; i += 1)
+/* Moves an image out of the way, into space that is clear of every image and every pending target.
+ * Neither this move nor the one on to its target copies onto itself.
+ * Returns 0 if the free list has no such space.
+ */
+static uint8_t Cram_Internal_StageLiveImage(Cram_Internal_Context *context, Cram_Internal_Compaction *compaction, int32_t index)
+{
+	Rect rect = context->liveImages[compaction->targetImages[index]].rect;
+
+	if (compaction->stagingPacker == NULL)
 	{
-		if (!internalContext->images[i]->duplicateOf)
-		{
-			packerRect = &packerRects[numRects];
+		Cram_Internal_BuildStagingPacker(context, compaction);
+	}
 
-			packerRect->w = internalContext->images[i]->trimmedRect.w + internalContext->padding;
-			packerRect->h = internalContext->images[i]->trimmedRect.h + internalContext->padding;
+	if (!Cram_Internal_FindStagingRect(compaction->stagingPacker, &rect))
+	{
+		return 0;
+	}
 
-			numRects += 1;
-		}
+	Cram_Internal_CompactionMove(context, compaction, index, rect.x, rect.y);
+	return 1;
+}
+
+int8_t Cram_Compact(Cram_Context *context, int32_t moveBudget, Cram_Move **pMoves, int32_t *pMoveCount)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	Cram_Internal_Compaction compaction;
+	Cram_Internal_LiveImage *liveImage;
+	Cram_Internal_Page *page;
+	RectPackContext *packer;
+	int32_t remaining = 0;
+	uint8_t staged;
+	int8_t result = 0;
+	int32_t i, j;
+
+	internalContext->moveCount = 0;
+
+	if (internalContext->livePacker == NULL)
+	{
+		*pMoves = internalContext->moves;
+		*pMoveCount = 0;
+		return 0;
 	}
 
-	/* If packing fails, increase a dimension by power of 2 and retry until we hit max dimensions. */
-	while (Cram_Internal_PackRects(rectPackContext, packerRects, numRects) < 0)
+	page = &internalContext->pages[0];
+
+	compaction.targets = malloc(sizeof(Rect) * internalContext->liveImageCount);
+	compaction.targetImages = malloc(sizeof(int32_t) * internalContext->liveImageCount);
+	compaction.targetCount = 0;
+
+	for (i = 0; i < internalContext->liveImageCount; i += 1)
 	{
-		if (increaseX)
-		{
-			rectPackContext->width *= 2;
-			increaseX = 0;
-		}
-		else
+		if (internalContext->liveImages[i].used)
 		{
-			rectPackContext->height *= 2;
-			increaseX = 1;
+			compaction.targets[compaction.targetCount] = internalContext->liveImages[i].rect;
+			compaction.targetImages[compaction.targetCount] = i;
+			compaction.targetCount += 1;
 		}
+	}
+
+	/* The target only depends on the image sizes, so an interrupted compaction heads for the same layout next time. */
+	packer = Cram_Internal_InitRectPacker(
+		page->width,
+		page->height,
+		internalContext->livePacker->heuristic,
+		0
+	);
+
+	Cram_Internal_PlacePackedImages(internalContext, packer);
+
+	if (Cram_Internal_PackMaxRects(packer, compaction.targets, compaction.targetCount) < 0)
+	{
+		/* the current layout is the only one we know fits */
+		compaction.targetCount = 0;
+	}
+
+	Cram_Internal_DestroyRectPacker(packer);
 
-		rectPackContext->freeRectangles[0].x = 0;
-		rectPackContext->freeRectangles[0].y = 0;
-		rectPackContext->freeRectangles[0].w = rectPackContext->width;
-		rectPackContext->freeRectangles[0].h = rectPackContext->height;
-		rectPackContext->freeRectangleCount = 1;
+	compaction.blockerCounts = calloc(compaction.targetCount, sizeof(int32_t));
+	compaction.blockingCounts = calloc(compaction.targetCount, sizeof(int32_t));
+	compaction.done = calloc(compaction.targetCount, sizeof(uint8_t));
+	compaction.ready = malloc(sizeof(int32_t) * compaction.targetCount);
+	compaction.readyCount = 0;
+	compaction.stagingPacker = NULL;
+	compaction.stagingFresh = 0;
+	compaction.stagingRebuilt = 0;
 
-		rectPackContext->newFreeRectangleCount = 0;
+	for (i = 0; i < compaction.targetCount; i += 1)
+	{
+		liveImage = &internalContext->liveImages[compaction.targetImages[i]];
 
-		if (rectPackContext->width > internalContext->maxDimension || rectPackContext->height > internalContext->maxDimension)
+		if (liveImage->rect.x == compaction.targets[i].x && liveImage->rect.y == compaction.targets[i].y)
 		{
-			break;
+			compaction.done[i] = 1;
+		}
+		else
+		{
+			remaining += 1;
 		}
 	}
 
-	if (rectPackContext->width > internalContext->maxDimension || rectPackContext->height > internalContext->maxDimension)
+	/* Targets don't overlap each other, so only images that haven't arrived yet can be in the way. */
+	for (i = 0; i < compaction.targetCount; i += 1)
 	{
-		/* Can't pack into max dimensions, abort! */
-		return -1;
+		for (j = 0; j < compaction.targetCount; j += 1)
+		{
+			if (	i != j &&
+					!compaction.done[i] &&
+					!compaction.done[j] &&
+					Cram_Internal_Overlaps(&compaction.targets[i], &internalContext->liveImages[compaction.targetImages[j]].rect)	)
+			{
+				compaction.blockerCounts[i] += 1;
+				compaction.blockingCounts[j] += 1;
+			}
+		}
 	}
 
-	numRects = 0;
-	for (i = 0; i < internalContext->imageCount; i += 1)
+	for (i = compaction.targetCount - 1; i >= 0; i -= 1)
 	{
-		if (!internalContext->images[i]->duplicateOf)
+		if (!compaction.done[i] && compaction.blockerCounts[i] == 0)
 		{
-			packerRect = &packerRects[numRects];
-
-			internalContext->images[i]->packedRect.x = packerRect->x;
-			internalContext->images[i]->packedRect.y = packerRect->y;
-			internalContext->images[i]->packedRect.w = internalContext->images[i]->trimmedRect.w;
-			internalContext->images[i]->packedRect.h = internalContext->images[i]->trimmedRect.h;
-
-			numRects += 1;
+			compaction.ready[compaction.readyCount] = i;
+			compaction.readyCount += 1;
 		}
 	}
 
-	internalContext->packedWidth = rectPackContext->width;
-	internalContext->packedHeight = rectPackContext->height;
-
-	internalContext->pixels = realloc(internalContext->pixels, internalContext->packedWidth  * internalContext->packedHeight * 4);
-	memset(internalContext->pixels, 0, internalContext->packedWidth * internalContext->packedHeight * 4);
-
-	for (i = 0; i < internalContext->imageCount; i += 1)
+	/* Only move images into space that is free right now, so every move stands on its own
+	 * and its source and destination never overlap.
+	 */
+	while (remaining > 0)
 	{
-		if (!internalContext->images[i]->duplicateOf)
+		if (moveBudget > 0 && internalContext->moveCount == moveBudget)
 		{
-			dstRect.x = internalContext->images[i]->packedRect.x;
-			dstRect.y = internalContext->images[i]->packedRect.y;
-			dstRect.w = internalContext->images[i]->trimmedRect.w;
-			dstRect.h = internalContext->images[i]->trimmedRect.h;
-
-			srcRect.x = 0;
-			srcRect.y = 0;
-			srcRect.w = internalContext->images[i]->trimmedRect.w;
-			srcRect.h = internalContext->images[i]->trimmedRect.h;
-
-			Cram_Internal_CopyPixels(
-				(uint32_t*) internalContext->pixels,
-				internalContext->packedWidth,
-				(uint32_t*) internalContext->images[i]->pixels,
-				internalContext->images[i]->trimmedRect.w,
-				&dstRect,
-				&srcRect
-			);
+			result = 1;
+			break;
 		}
 
-		if (internalContext->images[i]->duplicateOf)
+		if (compaction.readyCount > 0)
 		{
-			internalContext->imageDatas[i].x = internalContext->images[i]->duplicateOf->packedRect.x;
-			internalContext->imageDatas[i].y = internalContext->images[i]->duplicateOf->packedRect.y;
-			internalContext->imageDatas[i].width = internalContext->images[i]->duplicateOf->trimmedRect.w;
-			internalContext->imageDatas[i].height = internalContext->images[i]->duplicateOf->trimmedRect.h;
+			i = compaction.ready[compaction.readyCount - 1];
+			liveImage = &internalContext->liveImages[compaction.targetImages[i]];
+
+			if (Cram_Internal_Overlaps(&compaction.targets[i], &liveImage->rect))
+			{
+				/* it's in its own way, so it goes through free space first */
+				staged = Cram_Internal_StageLiveImage(internalContext, &compaction, i);
+
+				if (!staged && Cram_Internal_RefreshStagingPacker(internalContext, &compaction))
+				{
+					staged = Cram_Internal_StageLiveImage(internalContext, &compaction, i);
+				}
+
+				if (!staged && !compaction.stagingFresh)
+				{
+					/* pick it up again next call, with a fresh look at the free space */
+					result = 1;
+					break;
+				}
+
+				if (!staged)
+				{
+					/* no room to do that, it stays put */
+					compaction.readyCount -= 1;
+					compaction.done[i] = 1;
+					remaining -= 1;
+				}
+
+				/* on to its target next time around, budget permitting */
+				continue;
+			}
+
+			compaction.readyCount -= 1;
+			Cram_Internal_CompactionMove(internalContext, &compaction, i, compaction.targets[i].x, compaction.targets[i].y);
+			compaction.done[i] = 1;
+			remaining -= 1;
 		}
 		else
 		{
-			internalContext->imageDatas[i].x = internalContext->images[i]->packedRect.x;
-			internalContext->imageDatas[i].y = internalContext->images[i]->packedRect.y;
-			internalContext->imageDatas[i].width = internalContext->images[i]->trimmedRect.w;
-			internalContext->imageDatas[i].height = internalContext->images[i]->trimmedRect.h;
+			/* Every image left waits on another one, so there's a cycle.
+			 * Break it by moving an image that sits on someone else's target out of the way.
+			 */
+			do
+			{
+				staged = 0;
+
+				for (i = 0; i < compaction.targetCount && !staged; i += 1)
+				{
+					if (!compaction.done[i] && compaction.blockingCounts[i] > 0)
+					{
+						staged = Cram_Internal_StageLiveImage(internalContext, &compaction, i);
+					}
+				}
+			} while (!staged && Cram_Internal_RefreshStagingPacker(internalContext, &compaction));
+
+			if (!staged && !compaction.stagingFresh)
+			{
+				result = 1;
+				break;
+			}
+
+			if (!staged)
+			{
+				/* no free space left to shuffle through, the rest stay where they are */
+				break;
+			}
 		}
+	}
 
-		image = internalContext->images[i];
+	if (compaction.stagingPacker != NULL)
+	{
+		Cram_Internal_DestroyRectPacker(compaction.stagingPacker);
+	}
 
-		internalContext->imageDatas[i].trimOffsetX = image->originalRect.x - image->trimmedRect.x;
-		internalContext->imageDatas[i].trimOffsetY = image->originalRect.y - image->trimmedRect.y;
-		internalContext->imageDatas[i].untrimmedWidth = image->originalRect.w;
-		internalContext->imageDatas[i].untrimmedHeight = image->originalRect.h;
+	free(compaction.blockerCounts);
+	free(compaction.blockingCounts);
+	free(compaction.done);
+	free(compaction.ready);
+	free(compaction.targets);
+	free(compaction.targetImages);
 
-		internalContext->imageDatas[i].path = strdup(internalContext->images[i]->path);
+	/* Released rects don't join up with the free space around them, so start the free list over. */
+	Cram_Internal_ResetRectPacker(internalContext->livePacker, page->width, page->height);
+	Cram_Internal_PlacePackedImages(internalContext, internalContext->livePacker);
+
+	for (i = 0; i < internalContext->liveImageCount; i += 1)
+	{
+		if (internalContext->liveImages[i].used)
+		{
+			Cram_Internal_PlaceRect(internalContext->livePacker, &internalContext->liveImages[i].rect);
+		}
 	}
 
-	free(packerRects);
+	*pMoves = internalContext->moves;
+	*pMoveCount = internalContext->moveCount;
 
-	return 0;
+	return result;
 }
 
 void Cram_GetPixelData(Cram_Context *context, uint8_t **pPixels, int32_t *pWidth, int32_t *pHeight)
+{
+	Cram_GetPagePixelData(context, 0, pPixels, pWidth, pHeight);
+}
+
+int32_t Cram_GetPageCount(Cram_Context *context)
 {
 	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
-	*pPixels = internalContext->pixels;
-	*pWidth = internalContext->packedWidth;
-	*pHeight = internalContext->packedHeight;
+	return internalContext->pageCount;
+}
+
+void Cram_GetPagePixelData(Cram_Context *context, int32_t page, uint8_t **pPixels, int32_t *pWidth, int32_t *pHeight)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+
+	if (page < 0 || page >= internalContext->pageCount)
+	{
+		*pPixels = NULL;
+		*pWidth = 0;
+		*pHeight = 0;
+		return;
+	}
+
+	*pPixels = internalContext->pages[page].pixels;
+	*pWidth = internalContext->pages[page].width;
+	*pHeight = internalContext->pages[page].height;
 }
 
 void Cram_GetMetadata(Cram_Context *context, Cram_ImageData **pImage, int32_t *pImageCount)
@@ -776,19 +5604,34 @@ void Cram_GetMetadata(Cram_Context *context, Cram_ImageData **pImage, int32_t *p
 	*pImageCount = internalContext->imageDataCount;
 }
 
+void Cram_GetPackStats(Cram_Context *context, Cram_PackStats *pStats)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+	*pStats = internalContext->packStats;
+}
+
+void Cram_GetPackAttempts(Cram_Context *context, Cram_PackAttempt **pAttempts, int32_t *pAttemptCount)
+{
+	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
+
+	*pAttempts = internalContext->packAttempts;
+	*pAttemptCount = internalContext->packAttemptCount;
+}
+
 void Cram_Destroy(Cram_Context *context)
 {
 	Cram_Internal_Context *internalContext = (Cram_Internal_Context*) context;
 	int32_t i;
 
-	if (internalContext->pixels != NULL)
+	for (i = 0; i < internalContext->pageCount; i += 1)
 	{
-		free(internalContext->pixels);
+		free(internalContext->pages[i].pixels);
 	}
+	free(internalContext->pages);
 
 	for (i = 0; i < internalContext->imageCount; i += 1)
 	{
-		if (!internalContext->images[i]->duplicateOf)
+		if (!internalContext->images[i]->duplicateOf && !internalContext->images[i]->borrowed)
 		{
 			free(internalContext->images[i]->pixels);
 		}
@@ -797,8 +5640,21 @@ void Cram_Destroy(Cram_Context *context)
 		free(internalContext->images[i]);
 	}
 
+	hmfree(internalContext->imageMap);
+
+	for (i = 0; i < internalContext->imageDataCount; i += 1)
+	{
+		free(internalContext->imageDatas[i].path);
+	}
+
 	free(internalContext->name);
 	free(internalContext->images);
 	free(internalContext->imageDatas);
+	free(internalContext->packAttempts);
+
+	Cram_Internal_ResetLiveImages(internalContext);
+	free(internalContext->liveImages);
+	free(internalContext->moves);
+
 	free(internalContext);
 }
@@ -120,6 +120,11 @@ void JsonBuilder_AppendIntProperty(JsonBuilder *builder, char *propertyName, int
 	JsonBuilder_AppendProperty(builder, propertyName, buffer, 0);
 }
 
+void JsonBuilder_AppendBoolProperty(JsonBuilder *builder, char *propertyName, uint8_t value)
+{
+	JsonBuilder_AppendProperty(builder, propertyName, value ? "true" : "false", 0);
+}
+
 void JsonBuilder_StartObject(JsonBuilder *builder)
 {
 	JsonBuilder_Internal_Indent(builder);
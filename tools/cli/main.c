@@ -28,13 +28,22 @@
 #include "cram.h"
 #include "json_writer.h"
 
+#ifdef CRAM_IO_URING
+#include "uring_reader.h"
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 #define MAX_DIR_LENGTH 2048
+#define INITIAL_PATH_CAPACITY 256
 
 static Cram_Context *context;
 
+static char **paths;
+static int32_t pathCount;
+static int32_t pathCapacity;
+
 static const char* GetFilenameExtension(const char *filename)
 {
 	const char *dot = strrchr(filename, '.');
@@ -77,7 +86,14 @@ static void dirwalk(char *dir)
 		{
 			if (strcmp(GetFilenameExtension(subname), "png") == 0)
 			{
-				Cram_AddFile(context, subname);
+				if (pathCount == pathCapacity)
+				{
+					pathCapacity *= 2;
+					paths = realloc(paths, sizeof(char*) * pathCapacity);
+				}
+
+				paths[pathCount] = strdup(subname);
+				pathCount += 1;
 			}
 		}
 	}
@@ -89,7 +105,7 @@ static void dirwalk(char *dir)
 
 void print_help()
 {
-	fprintf(stdout, "Usage: cram input_dir output_dir atlas_name [--padding padding_value] [--premultiply] [--notrim] [--dimension max_dimension]");
+	fprintf(stdout, "Usage: cram input_dir output_dir atlas_name [--padding padding_value] [--premultiply] [--notrim] [--dimension max_dimension] [--threads thread_count] [--packer maxrects|skyline|skylinewaste|guillotine|shelf] [--heuristic area|shortside|longside|bottomleft|contact|auto] [--order bestfit|maxside|area|perimeter] [--size pow2|any|mult4|square] [--rotate] [--multipage] [--grow] [--optimize milliseconds] [--restarts restart_count] [--seed seed] [--stats]");
 }
 
 uint8_t check_dir_exists(char *path)
@@ -131,6 +147,36 @@ static char* replace(char *string, char character, char newCharacter)
 	return string;
 }
 
+/* Options that are followed by a value. */
+static const char *valueOptions[] =
+{
+	"--padding",
+	"--dimension",
+	"--threads",
+	"--heuristic",
+	"--size",
+	"--packer",
+	"--order",
+	"--optimize",
+	"--restarts",
+	"--seed"
+};
+
+static uint8_t option_has_value(const char *arg)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(valueOptions) / sizeof(valueOptions[0]); i += 1)
+	{
+		if (strcmp(arg, valueOptions[i]) == 0)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	Cram_ContextCreateInfo createInfo;
@@ -138,6 +184,7 @@ int main(int argc, char *argv[])
 	int32_t width;
 	int32_t height;
 	uint8_t premultiply;
+	uint8_t printStats;
 	uint8_t alpha;
 	char *arg;
 	char *inputDirPath = NULL;
@@ -148,6 +195,12 @@ int main(int argc, char *argv[])
 	JsonBuilder *jsonBuilder;
 	Cram_ImageData *imageDatas;
 	int32_t imageCount;
+	Cram_PackStats packStats;
+	Cram_PackAttempt *packAttempts;
+	int32_t packAttemptCount;
+	int32_t pageCount;
+	int32_t page;
+	char **pageNames;
 	int32_t i;
 
 	separatorString[0] = SEPARATOR;
@@ -158,7 +211,19 @@ int main(int argc, char *argv[])
 	createInfo.trim = 1;
 	createInfo.maxDimension = 8192;
 	createInfo.name = NULL;
+	createInfo.threadCount = 0;
+	createInfo.packerType = CRAM_PACKER_MAXRECTS;
+	createInfo.heuristic = CRAM_HEURISTIC_BEST_AREA_FIT;
+	createInfo.packOrder = CRAM_ORDER_BEST_FIT;
+	createInfo.sizeMode = CRAM_SIZE_POWER_OF_TWO;
+	createInfo.rotate = 0;
+	createInfo.multiPage = 0;
+	createInfo.growInPlace = 0;
+	createInfo.optimizeMilliseconds = 0;
+	createInfo.optimizeRestarts = 0;
+	createInfo.optimizeSeed = 0;
 	premultiply = 0;
+	printStats = 0;
 
 	if (argc < 2)
 	{
@@ -170,6 +235,13 @@ int main(int argc, char *argv[])
 	{
 		arg = argv[i];
 
+		if (option_has_value(arg) && i + 1 >= argc)
+		{
+			fprintf(stderr, "Missing value for %s!", arg);
+			print_help();
+			return 1;
+		}
+
 		if (strcmp(arg, "--padding") == 0)
 		{
 			i += 1;
@@ -198,6 +270,169 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 		}
+		else if (strcmp(arg, "--threads") == 0)
+		{
+			i += 1;
+			if (atoi(argv[i]) < 0)
+			{
+				fprintf(stderr, "Thread count must be equal to or greater than 0!");
+				return 1;
+			}
+			createInfo.threadCount = atoi(argv[i]);
+		}
+		else if (strcmp(arg, "--packer") == 0)
+		{
+			i += 1;
+			if (strcmp(argv[i], "maxrects") == 0)
+			{
+				createInfo.packerType = CRAM_PACKER_MAXRECTS;
+			}
+			else if (strcmp(argv[i], "skyline") == 0)
+			{
+				createInfo.packerType = CRAM_PACKER_SKYLINE;
+			}
+			else if (strcmp(argv[i], "skylinewaste") == 0)
+			{
+				createInfo.packerType = CRAM_PACKER_SKYLINE_WASTE_MAP;
+			}
+			else if (strcmp(argv[i], "guillotine") == 0)
+			{
+				createInfo.packerType = CRAM_PACKER_GUILLOTINE;
+			}
+			else if (strcmp(argv[i], "shelf") == 0)
+			{
+				createInfo.packerType = CRAM_PACKER_SHELF;
+			}
+			else
+			{
+				fprintf(stderr, "Unknown packer %s!", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--heuristic") == 0)
+		{
+			i += 1;
+			if (strcmp(argv[i], "area") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_BEST_AREA_FIT;
+			}
+			else if (strcmp(argv[i], "shortside") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_BEST_SHORT_SIDE_FIT;
+			}
+			else if (strcmp(argv[i], "longside") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_BEST_LONG_SIDE_FIT;
+			}
+			else if (strcmp(argv[i], "bottomleft") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_BOTTOM_LEFT;
+			}
+			else if (strcmp(argv[i], "contact") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_CONTACT_POINT;
+			}
+			else if (strcmp(argv[i], "auto") == 0)
+			{
+				createInfo.heuristic = CRAM_HEURISTIC_AUTO;
+			}
+			else
+			{
+				fprintf(stderr, "Unknown heuristic %s!", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--order") == 0)
+		{
+			i += 1;
+			if (strcmp(argv[i], "bestfit") == 0)
+			{
+				createInfo.packOrder = CRAM_ORDER_BEST_FIT;
+			}
+			else if (strcmp(argv[i], "maxside") == 0)
+			{
+				createInfo.packOrder = CRAM_ORDER_MAX_SIDE;
+			}
+			else if (strcmp(argv[i], "area") == 0)
+			{
+				createInfo.packOrder = CRAM_ORDER_AREA;
+			}
+			else if (strcmp(argv[i], "perimeter") == 0)
+			{
+				createInfo.packOrder = CRAM_ORDER_PERIMETER;
+			}
+			else
+			{
+				fprintf(stderr, "Unknown order %s!", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--size") == 0)
+		{
+			i += 1;
+			if (strcmp(argv[i], "pow2") == 0)
+			{
+				createInfo.sizeMode = CRAM_SIZE_POWER_OF_TWO;
+			}
+			else if (strcmp(argv[i], "any") == 0)
+			{
+				createInfo.sizeMode = CRAM_SIZE_ANY;
+			}
+			else if (strcmp(argv[i], "mult4") == 0)
+			{
+				createInfo.sizeMode = CRAM_SIZE_MULTIPLE_OF_FOUR;
+			}
+			else if (strcmp(argv[i], "square") == 0)
+			{
+				createInfo.sizeMode = CRAM_SIZE_SQUARE;
+			}
+			else
+			{
+				fprintf(stderr, "Unknown size mode %s!", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--rotate") == 0)
+		{
+			createInfo.rotate = 1;
+		}
+		else if (strcmp(arg, "--multipage") == 0)
+		{
+			createInfo.multiPage = 1;
+		}
+		else if (strcmp(arg, "--grow") == 0)
+		{
+			createInfo.growInPlace = 1;
+		}
+		else if (strcmp(arg, "--optimize") == 0)
+		{
+			i += 1;
+			if (atoi(argv[i]) < 0)
+			{
+				fprintf(stderr, "Optimize time must be equal to or greater than 0!");
+				return 1;
+			}
+			createInfo.optimizeMilliseconds = atoi(argv[i]);
+		}
+		else if (strcmp(arg, "--restarts") == 0)
+		{
+			i += 1;
+			if (atoi(argv[i]) < 0)
+			{
+				fprintf(stderr, "Restart count must be equal to or greater than 0!");
+				return 1;
+			}
+			createInfo.optimizeRestarts = atoi(argv[i]);
+		}
+		else if (strcmp(arg, "--seed") == 0)
+		{
+			i += 1;
+			createInfo.optimizeSeed = (uint32_t) strtoul(argv[i], NULL, 10);
+		}
+		else if (strcmp(arg, "--stats") == 0)
+		{
+			printStats = 1;
+		}
 		else if (strcmp(arg, "--help") == 0)
 		{
 			print_help();
@@ -241,53 +476,131 @@ int main(int argc, char *argv[])
 
 	context = Cram_Init(&createInfo);
 
+	pathCapacity = INITIAL_PATH_CAPACITY;
+	pathCount = 0;
+	paths = malloc(sizeof(char*) * pathCapacity);
+
 	dirwalk(inputDirPath);
 
+	/* Cram_AddFiles reads and decodes each file on the same worker, which also works when io_uring doesn't */
+#ifdef CRAM_IO_URING
+	if (!UringReader_AddFiles(context, (const char**) paths, pathCount))
+#endif
+	{
+		Cram_AddFiles(context, (const char**) paths, pathCount);
+	}
+
+	for (i = 0; i < pathCount; i += 1)
+	{
+		free(paths[i]);
+	}
+	free(paths);
+
 	if (Cram_Pack(context) < 0)
 	{
 		fprintf(stderr, "Not enough room! Packing aborted!");
 		return 1;
 	}
 
-	/* output pixel data */
+	if (printStats)
+	{
+		Cram_GetPackAttempts(context, &packAttempts, &packAttemptCount);
 
-	Cram_GetPixelData(context, &pixelData, &width, &height);
+		for (i = 0; i < packAttemptCount; i += 1)
+		{
+			fprintf(
+				stdout,
+				"Attempt: page %d %dx%d heuristic %d %s\n",
+				packAttempts[i].page,
+				packAttempts[i].width,
+				packAttempts[i].height,
+				packAttempts[i].heuristic,
+				packAttempts[i].success ? "fit" : "failed"
+			);
+		}
 
-	if (premultiply)
+		Cram_GetPackStats(context, &packStats);
+
+		fprintf(stdout, "Placements: %llu\n", (unsigned long long) packStats.placementCount);
+		fprintf(stdout, "Peak free rectangles: %d\n", packStats.freeRectanglePeak);
+
+		if (packStats.placementCount > 0)
+		{
+			fprintf(stdout, "Free rectangles per placement: %.1f\n", (double) packStats.freeRectangleTotal / packStats.placementCount);
+			fprintf(stdout, "Containment tests per placement: %.1f\n", (double) packStats.containmentTestCount / packStats.placementCount);
+		}
+	}
+
+	/* output pixel data, one image per page */
+
+	pageCount = Cram_GetPageCount(context);
+	pageNames = malloc(sizeof(char*) * pageCount);
+
+	for (page = 0; page < pageCount; page += 1)
 	{
-		for (i = 0; i < width * height * 4; i += 4)
+		Cram_GetPagePixelData(context, page, &pixelData, &width, &height);
+
+		if (premultiply)
 		{
-			alpha = pixelData[i + 3];
+			for (i = 0; i < width * height * 4; i += 4)
+			{
+				alpha = pixelData[i + 3];
 
-			pixelData[i + 0] = (uint8_t) (((uint32_t) (pixelData[i + 0]) * alpha) / 255);
-			pixelData[i + 1] = (uint8_t) (((uint32_t) (pixelData[i + 1]) * alpha) / 255);
-			pixelData[i + 2] = (uint8_t) (((uint32_t) (pixelData[i + 2]) * alpha) / 255);
+				pixelData[i + 0] = (uint8_t) (((uint32_t) (pixelData[i + 0]) * alpha) / 255);
+				pixelData[i + 1] = (uint8_t) (((uint32_t) (pixelData[i + 1]) * alpha) / 255);
+				pixelData[i + 2] = (uint8_t) (((uint32_t) (pixelData[i + 2]) * alpha) / 255);
+			}
+		}
+
+		/* a single page keeps the plain atlas name */
+		pageNames[page] = malloc(strlen(createInfo.name) + 12);
+		if (pageCount == 1)
+		{
+			strcpy(pageNames[page], createInfo.name);
+		}
+		else
+		{
+			sprintf(pageNames[page], "%s_%d", createInfo.name, page);
 		}
-	}
 
-	imageOutputFilename = malloc(strlen(outputDirPath) + strlen(createInfo.name) + 6);
-	strcpy(imageOutputFilename, outputDirPath);
-	strcat(imageOutputFilename, separatorString);
-	strcat(imageOutputFilename, createInfo.name);
-	strcat(imageOutputFilename, ".png");
-
-	stbi_write_png(
-		imageOutputFilename,
-		width,
-		height,
-		4,
-		pixelData,
-		width * 4
-	);
+		imageOutputFilename = malloc(strlen(outputDirPath) + strlen(pageNames[page]) + 6);
+		strcpy(imageOutputFilename, outputDirPath);
+		strcat(imageOutputFilename, separatorString);
+		strcat(imageOutputFilename, pageNames[page]);
+		strcat(imageOutputFilename, ".png");
+
+		stbi_write_png(
+			imageOutputFilename,
+			width,
+			height,
+			4,
+			pixelData,
+			width * 4
+		);
+
+		free(imageOutputFilename);
+	}
 
 	/* output json */
 
 	Cram_GetMetadata(context, &imageDatas, &imageCount);
 
 	jsonBuilder = JsonBuilder_Init();
+	Cram_GetPixelData(context, &pixelData, &width, &height);
 	JsonBuilder_AppendStringProperty(jsonBuilder, "Name", createInfo.name);
 	JsonBuilder_AppendIntProperty(jsonBuilder, "Width", width);
 	JsonBuilder_AppendIntProperty(jsonBuilder, "Height", height);
+	JsonBuilder_StartArrayProperty(jsonBuilder, "Pages");
+	for (page = 0; page < pageCount; page += 1)
+	{
+		Cram_GetPagePixelData(context, page, &pixelData, &width, &height);
+		JsonBuilder_StartObject(jsonBuilder);
+		JsonBuilder_AppendStringProperty(jsonBuilder, "Name", pageNames[page]);
+		JsonBuilder_AppendIntProperty(jsonBuilder, "Width", width);
+		JsonBuilder_AppendIntProperty(jsonBuilder, "Height", height);
+		JsonBuilder_EndObject(jsonBuilder);
+	}
+	JsonBuilder_FinishArrayProperty(jsonBuilder);
 	JsonBuilder_StartArrayProperty(jsonBuilder, "Images");
 	for (i = 0; i < imageCount; i += 1)
 	{
@@ -297,6 +610,8 @@ int main(int argc, char *argv[])
 		JsonBuilder_AppendIntProperty(jsonBuilder, "Y", imageDatas[i].y);
 		JsonBuilder_AppendIntProperty(jsonBuilder, "W", imageDatas[i].width);
 		JsonBuilder_AppendIntProperty(jsonBuilder, "H", imageDatas[i].height);
+		JsonBuilder_AppendBoolProperty(jsonBuilder, "Rotated", imageDatas[i].rotated);
+		JsonBuilder_AppendIntProperty(jsonBuilder, "Page", imageDatas[i].page);
 		JsonBuilder_AppendIntProperty(jsonBuilder, "TrimOffsetX", imageDatas[i].trimOffsetX);
 		JsonBuilder_AppendIntProperty(jsonBuilder, "TrimOffsetY", imageDatas[i].trimOffsetY);
 		JsonBuilder_AppendIntProperty(jsonBuilder, "UntrimmedWidth", imageDatas[i].untrimmedWidth);
@@ -324,7 +639,11 @@ int main(int argc, char *argv[])
 	JsonBuilder_Destroy(jsonBuilder);
 	fclose(jsonOutput);
 
-	free(imageOutputFilename);
+	for (page = 0; page < pageCount; page += 1)
+	{
+		free(pageNames[page]);
+	}
+	free(pageNames);
 	free(metadataFilename);
 	Cram_Destroy(context);
 
@@ -0,0 +1,414 @@
+/* Cram - A texture packing system in C
+ *
+ * Copyright (c) 2022 Evan Hemsley
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from
+ * the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be
+ * appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Evan "cosmonaut" Hemsley <evan@moonside.games>
+ *
+ */
+
+#ifndef URING_READER_H
+#define URING_READER_H
+
+/* Reads the input files with io_uring, many at a time, and hands them to Cram in order
+ * while later reads are still in flight. Uses the raw syscalls, so there is no liburing dependency.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "cram.h"
+
+#define URING_ENTRIES 64
+#define URING_MAX_BYTES_IN_FLIGHT (64 * 1024 * 1024) /* read but not yet decoded, one file can go over */
+#define URING_DECODE_BATCH_BYTES (4 * 1024 * 1024)
+
+typedef struct UringFile
+{
+	int fd;
+	uint8_t *data; /* NULL if the file couldn't be read */
+	size_t size;
+	size_t done;
+	uint8_t complete;
+} UringFile;
+
+typedef struct UringReader
+{
+	int ringFd;
+	uint32_t entries;
+
+	uint8_t *sqRing;
+	size_t sqRingSize;
+	uint8_t *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	uint32_t *sqTail;
+	uint32_t *sqMask;
+	uint32_t *sqArray;
+	uint32_t *cqHead;
+	uint32_t *cqTail;
+	uint32_t *cqMask;
+	struct io_uring_cqe *cqes;
+
+	/* Reads are never queued past the ring size, so the completion queue can't overflow. */
+	uint32_t inFlight;
+	uint32_t toSubmit;
+} UringReader;
+
+void UringReader_Internal_Destroy(UringReader *reader)
+{
+	if (reader->sqes != MAP_FAILED)
+	{
+		munmap(reader->sqes, reader->sqesSize);
+	}
+
+	if (reader->cqRing != MAP_FAILED && reader->cqRing != reader->sqRing)
+	{
+		munmap(reader->cqRing, reader->cqRingSize);
+	}
+
+	if (reader->sqRing != MAP_FAILED)
+	{
+		munmap(reader->sqRing, reader->sqRingSize);
+	}
+
+	close(reader->ringFd);
+}
+
+/* Returns 0 if io_uring isn't available, for example on old kernels or in sandboxes that block it. */
+uint8_t UringReader_Internal_Init(UringReader *reader)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	reader->ringFd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (reader->ringFd < 0)
+	{
+		return 0;
+	}
+
+	reader->entries = params.sq_entries;
+	reader->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	reader->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	reader->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		reader->sqRingSize = max(reader->sqRingSize, reader->cqRingSize);
+		reader->cqRingSize = reader->sqRingSize;
+	}
+
+	reader->sqRing = mmap(NULL, reader->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_SQ_RING);
+	reader->cqRing = MAP_FAILED;
+	reader->sqes = MAP_FAILED;
+
+	if (reader->sqRing != MAP_FAILED)
+	{
+		reader->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ?
+			reader->sqRing :
+			mmap(NULL, reader->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_CQ_RING);
+		reader->sqes = mmap(NULL, reader->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->ringFd, IORING_OFF_SQES);
+	}
+
+	if (reader->sqRing == MAP_FAILED || reader->cqRing == MAP_FAILED || reader->sqes == MAP_FAILED)
+	{
+		UringReader_Internal_Destroy(reader);
+		return 0;
+	}
+
+	reader->sqTail = (uint32_t*) (reader->sqRing + params.sq_off.tail);
+	reader->sqMask = (uint32_t*) (reader->sqRing + params.sq_off.ring_mask);
+	reader->sqArray = (uint32_t*) (reader->sqRing + params.sq_off.array);
+	reader->cqHead = (uint32_t*) (reader->cqRing + params.cq_off.head);
+	reader->cqTail = (uint32_t*) (reader->cqRing + params.cq_off.tail);
+	reader->cqMask = (uint32_t*) (reader->cqRing + params.cq_off.ring_mask);
+	reader->cqes = (struct io_uring_cqe*) (reader->cqRing + params.cq_off.cqes);
+
+	reader->inFlight = 0;
+	reader->toSubmit = 0;
+
+	return 1;
+}
+
+/* Reads whatever the ring couldn't synchronously. */
+void UringReader_Internal_ReadRest(UringFile *file)
+{
+	ssize_t bytesRead;
+
+	while (file->done < file->size)
+	{
+		bytesRead = pread(file->fd, file->data + file->done, file->size - file->done, file->done);
+		if (bytesRead < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytesRead <= 0)
+		{
+			break;
+		}
+		file->done += bytesRead;
+	}
+
+	if (file->done < file->size)
+	{
+		free(file->data);
+		file->data = NULL;
+	}
+}
+
+void UringReader_Internal_Complete(UringFile *file)
+{
+	close(file->fd);
+	file->fd = -1;
+	file->complete = 1;
+}
+
+void UringReader_Internal_QueueRead(UringReader *reader, UringFile *file, uint64_t index)
+{
+	uint32_t tail = *reader->sqTail;
+	uint32_t slot = tail & *reader->sqMask;
+	struct io_uring_sqe *sqe = &reader->sqes[slot];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = file->fd;
+	sqe->addr = (uint64_t) (uintptr_t) (file->data + file->done);
+	sqe->len = (uint32_t) (file->size - file->done);
+	sqe->off = file->done;
+	sqe->user_data = index;
+
+	reader->sqArray[slot] = slot;
+	__atomic_store_n(reader->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	reader->inFlight += 1;
+	reader->toSubmit += 1;
+}
+
+void UringReader_Internal_Enter(UringReader *reader, uint32_t waitCount)
+{
+	long result = syscall(
+		__NR_io_uring_enter,
+		reader->ringFd,
+		reader->toSubmit,
+		waitCount,
+		waitCount > 0 ? IORING_ENTER_GETEVENTS : 0,
+		NULL,
+		0
+	);
+
+	if (result >= 0)
+	{
+		reader->toSubmit -= (uint32_t) result;
+	}
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	{
+		/* buffers may still be in flight, so there is no safe way to carry on without the ring */
+		fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+void UringReader_Internal_Reap(UringReader *reader, UringFile *files)
+{
+	uint32_t head = *reader->cqHead;
+	uint32_t tail = __atomic_load_n(reader->cqTail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	UringFile *file;
+
+	while (head != tail)
+	{
+		cqe = &reader->cqes[head & *reader->cqMask];
+		file = &files[cqe->user_data];
+		reader->inFlight -= 1;
+
+		/* a read of 0 means the file got shorter since it was sized, so it ends here */
+		if (cqe->res > 0)
+		{
+			file->done += cqe->res;
+		}
+
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN || (cqe->res > 0 && file->done < file->size))
+		{
+			UringReader_Internal_QueueRead(reader, file, cqe->user_data);
+		}
+		else
+		{
+			if (cqe->res < 0)
+			{
+				UringReader_Internal_ReadRest(file);
+			}
+
+			UringReader_Internal_Complete(file);
+		}
+
+		head += 1;
+	}
+
+	__atomic_store_n(reader->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Opens and sizes a file. Unreadable files complete right away with no data. */
+void UringReader_Internal_Open(UringFile *file, const char *path)
+{
+	struct stat fileStat;
+
+	file->data = NULL;
+	file->size = 0;
+	file->done = 0;
+	file->complete = 0;
+
+	file->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (file->fd < 0)
+	{
+		file->complete = 1;
+		return;
+	}
+
+	if (fstat(file->fd, &fileStat) != 0 || fileStat.st_size <= 0 || fileStat.st_size > INT32_MAX)
+	{
+		UringReader_Internal_Complete(file);
+		return;
+	}
+
+	file->size = fileStat.st_size;
+}
+
+/* Adds the files to the context exactly as Cram_AddFiles would.
+ * Reads run ahead of decoding, bounded by URING_MAX_BYTES_IN_FLIGHT, and every run of files
+ * whose reads have finished is decoded while the reads after it carry on.
+ * Returns 0 without adding anything if io_uring is unavailable.
+ */
+uint8_t UringReader_AddFiles(Cram_Context *context, const char **paths, int32_t pathCount)
+{
+	UringReader reader;
+	UringFile *files;
+	const void **data;
+	size_t *lengths;
+	size_t bytesInFlight = 0, decodableBytes = 0;
+	int32_t openCount = 0, queuedCount = 0, completeCount = 0, decodedCount = 0;
+	uint8_t decode, failed = 0;
+	int32_t i;
+
+	if (pathCount <= 0)
+	{
+		return 1;
+	}
+
+	if (!UringReader_Internal_Init(&reader))
+	{
+		return 0;
+	}
+
+	files = malloc(sizeof(UringFile) * pathCount);
+	data = malloc(sizeof(void*) * pathCount);
+	lengths = malloc(sizeof(size_t) * pathCount);
+
+	while (decodedCount < pathCount)
+	{
+		/* queue reads in path order while the ring and the byte budget allow */
+		while (queuedCount < pathCount && reader.inFlight < reader.entries)
+		{
+			if (openCount == queuedCount)
+			{
+				UringReader_Internal_Open(&files[openCount], paths[openCount]);
+				openCount += 1;
+			}
+
+			if (!files[queuedCount].complete)
+			{
+				if (bytesInFlight > 0 && bytesInFlight + files[queuedCount].size > URING_MAX_BYTES_IN_FLIGHT)
+				{
+					break;
+				}
+
+				files[queuedCount].data = malloc(files[queuedCount].size);
+				bytesInFlight += files[queuedCount].size;
+				UringReader_Internal_QueueRead(&reader, &files[queuedCount], queuedCount);
+			}
+
+			queuedCount += 1;
+		}
+
+		/* nothing to decode yet, so wait for a read to finish */
+		decode = completeCount > decodedCount && (completeCount == queuedCount || decodableBytes >= URING_DECODE_BATCH_BYTES);
+		UringReader_Internal_Enter(&reader, !decode && reader.inFlight > 0 ? 1 : 0);
+		UringReader_Internal_Reap(&reader, files);
+
+		while (completeCount < queuedCount && files[completeCount].complete)
+		{
+			decodableBytes += files[completeCount].size;
+			completeCount += 1;
+		}
+
+		decode = completeCount > decodedCount && (completeCount == queuedCount || decodableBytes >= URING_DECODE_BATCH_BYTES);
+
+		if (decode)
+		{
+			for (i = decodedCount; i < completeCount; i += 1)
+			{
+				data[i] = files[i].data;
+				lengths[i] = files[i].done;
+			}
+
+			if (Cram_AddEncodedBatch(context, &paths[decodedCount], &data[decodedCount], &lengths[decodedCount], completeCount - decodedCount) < 0)
+			{
+				failed = 1;
+			}
+
+			for (i = decodedCount; i < completeCount; i += 1)
+			{
+				free(files[i].data);
+				files[i].data = NULL;
+				bytesInFlight -= files[i].size;
+			}
+
+			decodableBytes = 0;
+			decodedCount = completeCount;
+		}
+	}
+
+	if (failed)
+	{
+		fprintf(stderr, "Some images could not be read or decoded and were skipped!\n");
+	}
+
+	free(files);
+	free(data);
+	free(lengths);
+
+	UringReader_Internal_Destroy(&reader);
+
+	return 1;
+}
+
+#endif /* URING_READER_H */